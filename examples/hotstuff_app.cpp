@@ -131,6 +131,24 @@ class HotStuffApp: public HotStuff {
     void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps);
     void set_fanout(int32_t fanout);
     void set_piped_latency(int32_t piped_latency, int32_t async_blocks);
+    void set_adaptive_pipeline(bool adaptive_pipeline);
+    void set_optimistic_verify(bool optimistic_verify);
+    void set_vote_batch_window(double window);
+    void set_agg_timeout(double agg_timeout);
+    void set_reconfig_timeout(double reconfig_timeout);
+    void set_topology(hotstuff::TopologyBuilder *builder);
+    void set_latency_tree(bool latency_tree);
+    void set_ntrees(int32_t ntrees);
+    void set_chunk_size(size_t size, size_t max_msg_size);
+    void set_erasure_coding(bool enabled);
+    void set_batch_size(size_t size);
+    void set_coalesce_window(double window);
+    void set_ctl_port_offset(uint16_t offset);
+    void set_sparse_mesh(bool enabled);
+    void set_async_parse(bool enabled);
+    void set_blk_bytes(size_t bytes);
+    void set_blk_deadline(double deadline);
+    void set_blk_size_bounds(size_t min, size_t max);
     void stop();
 };
 
@@ -176,6 +194,26 @@ int main(int argc, char **argv) {
     auto opt_fanout = Config::OptValInt::create(2); // 2 by default
     auto opt_piped_latency = Config::OptValInt::create(10); // 10ms by default
     auto opt_async_blocks = Config::OptValInt::create(0); // 0 by default
+    auto opt_adaptive_pipeline = Config::OptValFlag::create(false);
+    auto opt_optimistic_verify = Config::OptValFlag::create(false);
+    auto opt_vote_batch_window = Config::OptValDouble::create(0); // disabled by default
+    auto opt_agg_timeout = Config::OptValDouble::create(0); // wait for the whole subtree by default
+    auto opt_reconfig_timeout = Config::OptValDouble::create(0); // fixed tree by default
+    auto opt_topology = Config::OptValStr::create("kary");
+    auto opt_topology_file = Config::OptValStr::create();
+    auto opt_latency_tree = Config::OptValFlag::create(false);
+    auto opt_ntrees = Config::OptValInt::create(1); // 1 by default
+    auto opt_chunk_size = Config::OptValInt::create(0); // whole blocks by default
+    auto opt_erasure_coding = Config::OptValFlag::create(false);
+    auto opt_batch_size = Config::OptValInt::create(0); // commands inline by default
+    auto opt_coalesce_window = Config::OptValDouble::create(-1); // disabled by default
+    auto opt_ctl_port_offset = Config::OptValInt::create(0); // one connection by default
+    auto opt_sparse_mesh = Config::OptValFlag::create(false);
+    auto opt_async_parse = Config::OptValFlag::create(false);
+    auto opt_blk_bytes = Config::OptValInt::create(0); // no byte budget by default
+    auto opt_blk_deadline = Config::OptValDouble::create(0); // wait for a full block by default
+    auto opt_blk_size_min = Config::OptValInt::create(1);
+    auto opt_blk_size_max = Config::OptValInt::create(0); // fixed block size by default
 
     config.add_opt("block-size", opt_blk_size, Config::SET_VAL);
     config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
@@ -203,6 +241,26 @@ int main(int argc, char **argv) {
     config.add_opt("fan-out", opt_fanout, Config::SET_VAL, 'F', "fanout");
     config.add_opt("piped_latency", opt_piped_latency, Config::SET_VAL, 'P', "Latency between the block pipelining");
     config.add_opt("async_blocks", opt_async_blocks, Config::SET_VAL, 'A', "Async blocks to pipeline");
+    config.add_opt("adaptive-pipeline", opt_adaptive_pipeline, Config::SWITCH_ON, 'D', "tune the pipeline depth (at most async_blocks) and delay (at least piped_latency) online");
+    config.add_opt("optimistic-verify", opt_optimistic_verify, Config::SWITCH_ON, 'O', "only verify the aggregate of the child votes");
+    config.add_opt("vote-batch-window", opt_vote_batch_window, Config::SET_VAL, 'V', "seconds to wait for signatures on the same block to batch-verify (0 to disable)");
+    config.add_opt("agg-timeout", opt_agg_timeout, Config::SET_VAL, 'T', "minimal seconds an internal node waits for its subtree before relaying a partial aggregate (0 to disable)");
+    config.add_opt("reconfig-timeout", opt_reconfig_timeout, Config::SET_VAL, 'R', "seconds without a new QC before the root rotates the tree (0 to disable)");
+    config.add_opt("topology", opt_topology, Config::SET_VAL, 'g', "specify the dissemination tree (star, kary, bounded, file)");
+    config.add_opt("topology-file", opt_topology_file, Config::SET_VAL, 'G', "the bandwidth of every replica (for bounded) or the parent of every replica (for file)");
+    config.add_opt("latency-tree", opt_latency_tree, Config::SWITCH_ON, 'L', "measure the round-trip times at start and switch to a latency-aware tree");
+    config.add_opt("trees", opt_ntrees, Config::SET_VAL, 'K', "number of disjoint dissemination trees used in turn");
+    config.add_opt("chunk-size", opt_chunk_size, Config::SET_VAL, 'C', "bytes per chunk when relaying large blocks down the tree (0 to disable)");
+    config.add_opt("erasure-coding", opt_erasure_coding, Config::SWITCH_ON, 'E', "send every subtree different coded fragments of the block and rebuild it from the other replicas");
+    config.add_opt("batch-size", opt_batch_size, Config::SET_VAL, 'W', "commands per batch spread by the replicas, blocks carry only batch digests (0 to disable)");
+    config.add_opt("coalesce-window", opt_coalesce_window, Config::SET_VAL, 'X', "seconds to bundle the votes to the same replica, 0 for one event-loop iteration (negative to disable)");
+    config.add_opt("ctl-port-offset", opt_ctl_port_offset, Config::SET_VAL, 'Y', "send votes over a second connection to the replica port plus this offset (0 to disable)");
+    config.add_opt("sparse-mesh", opt_sparse_mesh, Config::SWITCH_ON, 'Z', "connect to the tree neighbours only and to the other replicas on demand");
+    config.add_opt("async-parse", opt_async_parse, Config::SWITCH_ON, 'Q', "deserialize blocks and certificates on the worker threads");
+    config.add_opt("block-bytes", opt_blk_bytes, Config::SET_VAL, 'J', "also cut a block once its commands reach this many bytes (0 to disable)");
+    config.add_opt("block-deadline", opt_blk_deadline, Config::SET_VAL, 'H', "also cut a block once its oldest command waited this many seconds (0 to disable)");
+    config.add_opt("block-size-min", opt_blk_size_min, Config::SET_VAL, 'N', "the smallest block size when tuning it with the load");
+    config.add_opt("block-size-max", opt_blk_size_max, Config::SET_VAL, 'U', "tune the block size with the load up to this many commands (0 to keep block-size)");
 
     EventContext ec;
     config.parse(argc, argv);
@@ -290,6 +348,32 @@ int main(int argc, char **argv) {
 
     papp->set_fanout(opt_fanout->get());
     papp->set_piped_latency(opt_piped_latency->get(), opt_async_blocks->get());
+    papp->set_adaptive_pipeline(opt_adaptive_pipeline->get());
+    papp->set_optimistic_verify(opt_optimistic_verify->get());
+    papp->set_vote_batch_window(opt_vote_batch_window->get());
+    papp->set_agg_timeout(opt_agg_timeout->get());
+    papp->set_reconfig_timeout(opt_reconfig_timeout->get());
+    if (opt_topology->get() == "star")
+        papp->set_topology(new hotstuff::TopologyStar());
+    else if (opt_topology->get() == "bounded")
+        papp->set_topology(new hotstuff::TopologyDegreeBounded(opt_fanout->get(),
+                hotstuff::TopologyDegreeBounded::read_bandwidth(opt_topology_file->get())));
+    else if (opt_topology->get() == "file")
+        papp->set_topology(new hotstuff::TopologyFile(opt_topology_file->get()));
+    else
+        papp->set_topology(new hotstuff::TopologyKAry(opt_fanout->get()));
+    papp->set_latency_tree(opt_latency_tree->get());
+    papp->set_ntrees(opt_ntrees->get());
+    papp->set_chunk_size(opt_chunk_size->get(), opt_max_rep_msg->get());
+    papp->set_erasure_coding(opt_erasure_coding->get());
+    papp->set_batch_size(opt_batch_size->get());
+    papp->set_coalesce_window(opt_coalesce_window->get());
+    papp->set_ctl_port_offset(opt_ctl_port_offset->get());
+    papp->set_sparse_mesh(opt_sparse_mesh->get());
+    papp->set_async_parse(opt_async_parse->get());
+    papp->set_blk_bytes(opt_blk_bytes->get());
+    papp->set_blk_deadline(opt_blk_deadline->get());
+    papp->set_blk_size_bounds(opt_blk_size_min->get(), opt_blk_size_max->get());
 
     auto shutdown = [&](int) { papp->stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
@@ -346,12 +430,13 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
 
 void HotStuffApp::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
     const NetAddr addr = conn->get_addr();
+    const size_t cmd_size = msg.serialized.size();
     auto cmd = parse_cmd(msg.serialized);
     const auto &cmd_hash = cmd->get_hash();
     HOTSTUFF_LOG_DEBUG("processing %s", std::string(*cmd).c_str());
     exec_command(cmd_hash, [this, addr](Finality fin) {
         resp_queue.enqueue(std::make_pair(fin, addr));
-    });
+    }, cmd_size);
 }
 
 void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps) {
@@ -429,3 +514,75 @@ void HotStuffApp::set_fanout(int32_t fanout) {
 void HotStuffApp::set_piped_latency(int32_t piped_latency, int32_t async_blocks) {
     HotStuff::set_piped_latency(piped_latency, async_blocks);
 }
+
+void HotStuffApp::set_adaptive_pipeline(bool adaptive_pipeline) {
+    HotStuff::set_adaptive_pipeline(adaptive_pipeline);
+}
+
+void HotStuffApp::set_optimistic_verify(bool optimistic_verify) {
+    HotStuff::set_optimistic_verify(optimistic_verify);
+}
+
+void HotStuffApp::set_vote_batch_window(double window) {
+    HotStuff::set_vote_batch_window(window);
+}
+
+void HotStuffApp::set_agg_timeout(double agg_timeout) {
+    HotStuff::set_agg_timeout(agg_timeout);
+}
+
+void HotStuffApp::set_reconfig_timeout(double reconfig_timeout) {
+    HotStuff::set_reconfig_timeout(reconfig_timeout);
+}
+
+void HotStuffApp::set_topology(hotstuff::TopologyBuilder *builder) {
+    HotStuff::set_topology(builder);
+}
+
+void HotStuffApp::set_latency_tree(bool latency_tree) {
+    HotStuff::set_latency_tree(latency_tree);
+}
+
+void HotStuffApp::set_ntrees(int32_t ntrees) {
+    HotStuff::set_ntrees(ntrees);
+}
+
+void HotStuffApp::set_chunk_size(size_t size, size_t max_msg_size) {
+    HotStuff::set_chunk_size(size, max_msg_size);
+}
+
+void HotStuffApp::set_erasure_coding(bool enabled) {
+    HotStuff::set_erasure_coding(enabled);
+}
+
+void HotStuffApp::set_batch_size(size_t size) {
+    HotStuff::set_batch_size(size);
+}
+
+void HotStuffApp::set_coalesce_window(double window) {
+    HotStuff::set_coalesce_window(window);
+}
+
+void HotStuffApp::set_ctl_port_offset(uint16_t offset) {
+    HotStuff::set_ctl_port_offset(offset);
+}
+
+void HotStuffApp::set_sparse_mesh(bool enabled) {
+    HotStuff::set_sparse_mesh(enabled);
+}
+
+void HotStuffApp::set_async_parse(bool enabled) {
+    HotStuff::set_async_parse(enabled);
+}
+
+void HotStuffApp::set_blk_bytes(size_t bytes) {
+    HotStuff::set_blk_bytes(bytes);
+}
+
+void HotStuffApp::set_blk_deadline(double deadline) {
+    HotStuff::set_blk_deadline(deadline);
+}
+
+void HotStuffApp::set_blk_size_bounds(size_t min, size_t max) {
+    HotStuff::set_blk_size_bounds(min, max);
+}
@@ -49,6 +49,9 @@ int max_iter_num;
 uint32_t cid;
 uint32_t cnt = 0;
 uint32_t nfaulty;
+/** send every command to one replica in turn instead of replica 0 */
+bool spread;
+size_t next_replica = 0;
 
 struct Request {
     command_t cmd;
@@ -66,7 +69,14 @@ std::vector<std::pair<struct timeval, double>> elapsed;
 Net mn(ec, Net::Config());
 
 void connect_all() {
-    conns.insert(std::make_pair(0, mn.connect_sync(replicas[0])));
+    if (!spread)
+    {
+        conns.insert(std::make_pair(0, mn.connect_sync(replicas[0])));
+        return;
+    }
+    /* the replicas forward the commands to the proposer */
+    for (size_t i = 0; i < replicas.size(); i++)
+        conns.insert(std::make_pair(i, mn.connect_sync(replicas[i])));
 }
 
 bool try_send(bool check = true) {
@@ -74,8 +84,11 @@ bool try_send(bool check = true) {
     {
         auto cmd = new CommandDummy(cid, cnt++);
         MsgReqCmd msg(*cmd);
-        for (auto &p: conns)
-            mn.send_msg(msg, p.second);
+        if (spread)
+            mn.send_msg(msg, conns[next_replica++ % conns.size()]);
+        else
+            for (auto &p: conns)
+                mn.send_msg(msg, p.second);
 
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
         HOTSTUFF_LOG_INFO("send new cmd %.10s",
@@ -125,6 +138,7 @@ int main(int argc, char **argv) {
     auto opt_max_iter_num = Config::OptValInt::create(100);
     auto opt_max_async_num = Config::OptValInt::create(10);
     auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_spread = Config::OptValFlag::create(false);
 
     auto shutdown = [&](int) { ec.stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
@@ -140,10 +154,12 @@ int main(int argc, char **argv) {
     config.add_opt("replica", opt_replicas, Config::APPEND);
     config.add_opt("iter", opt_max_iter_num, Config::SET_VAL);
     config.add_opt("max-async", opt_max_async_num, Config::SET_VAL);
+    config.add_opt("spread", opt_spread, Config::SWITCH_ON);
     config.parse(argc, argv);
     auto idx = opt_idx->get();
     max_iter_num = opt_max_iter_num->get();
     max_async_num = opt_max_async_num->get();
+    spread = opt_spread->get();
     std::vector<std::string> raw;
     for (const auto &s: opt_replicas->get())
     {
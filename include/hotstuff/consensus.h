@@ -19,6 +19,7 @@
 #define _HOTSTUFF_CONSENSUS_H
 
 #include <cassert>
+#include <list>
 #include <set>
 #include <unordered_map>
 
@@ -34,6 +35,97 @@ struct Vote;
 struct Finality;
 struct VoteRelay;
 
+/** The blocks the proposer pipelined ahead of the regular ones, in proposal
+ * order. Membership, removal and finding the pipelined child of a block are
+ * constant time, so the cost per block does not grow with the depth of the
+ * pipeline. */
+class PipelineWindow {
+    struct Entry {
+        block_t blk;
+        std::list<uint256_t>::iterator pos;
+        /** got its QC, but waits for its predecessor to finish first */
+        bool certified;
+    };
+    std::list<uint256_t> order;
+    std::unordered_map<uint256_t, Entry> entries;
+    /** pipelined children by the hash of their first parent */
+    std::unordered_map<uint256_t, std::vector<uint256_t>> children;
+
+    void unlink(const block_t &blk);
+
+    public:
+    bool empty() const { return order.empty(); }
+    size_t size() const { return order.size(); }
+    bool contains(const uint256_t &hash) const { return entries.count(hash); }
+    /** Returns the pipelined block with the given hash, nullptr if none. */
+    block_t find(const uint256_t &hash) const;
+    /** The oldest pipelined block. */
+    const block_t &front() const { return entries.at(order.front()).blk; }
+    /** The newest (and highest) pipelined block. */
+    const block_t &back() const { return entries.at(order.back()).blk; }
+
+    void push_back(const block_t &blk);
+    void pop_front() { erase(order.front()); }
+    /** Removes the block with the given hash, returns false if it was not in
+     * the window. */
+    bool erase(const uint256_t &hash);
+    template<typename Pred> void erase_if(Pred pred) {
+        for (auto it = order.begin(); it != order.end();)
+        {
+            uint256_t hash = *it++;
+            if (pred(entries.at(hash).blk)) erase(hash);
+        }
+    }
+
+    /** Marks a block that got its QC before its predecessor did. */
+    void set_certified(const uint256_t &hash);
+    /** Removes and returns, in chain order, the marked blocks that now follow
+     * `blk` without a gap. */
+    std::vector<block_t> drain_certified(const block_t &blk);
+};
+
+/** Picks the number of pipelined blocks in flight and the delay between
+ * them (in milliseconds) from the smoothed proposal-to-QC latency and gap
+ * between proposals, so that blocks keep flowing during one QC round trip.
+ * Blocks that get their QC out of order (stalls) back the delay off. */
+class PipelineController {
+    static constexpr double alpha = 0.125;
+    static constexpr double max_backoff = 8;
+    static constexpr size_t max_tracked = 1024;
+
+    int32_t max_depth;
+    int32_t min_delay;
+    int32_t depth;
+    int32_t delay;
+    double qc_latency;
+    double gap;
+    double backoff;
+    double last_sent;
+    size_t stalls;
+    size_t part_stalls;
+    /** proposal time of the blocks waiting for their QC */
+    std::unordered_map<uint256_t, double> sent;
+
+    public:
+    PipelineController():
+        max_depth(1), min_delay(0), depth(1), delay(0),
+        qc_latency(0), gap(0), backoff(1), last_sent(0),
+        stalls(0), part_stalls(0) {}
+
+    /** Sets the upper bound of the depth and the lower bound of the delay. */
+    void init(int32_t max_depth, int32_t min_delay);
+    void on_propose(const uint256_t &blk_hash);
+    /** Returns true if the block was tracked and the decision was updated. */
+    bool on_qc(const uint256_t &blk_hash);
+    void on_stall() { stalls++; part_stalls++; }
+
+    int32_t get_depth() const { return depth; }
+    int32_t get_delay() const { return delay; }
+    double get_qc_latency() const { return qc_latency; }
+    double get_gap() const { return gap; }
+    size_t get_stalls() const { return stalls; }
+};
+
 /** Abstraction for HotStuff protocol state machine (without network implementation). */
 class HotStuffCore {
     block_t b0;                                  /** the genesis block */
@@ -94,7 +186,6 @@ bool rdy = false;
 
 public:
     BoxObj<EntityStorage> storage;
-    uint16_t numberOfChildren;
 
     HotStuffCore(ReplicaID id, privkey_bt &&priv_key);
     virtual ~HotStuffCore() {
@@ -114,6 +205,24 @@ public:
     /** Call to set the piped latency */
     void set_piped_latency(int32_t piped_latency, int32_t async_blocks);
 
+    /** Call to tune the pipeline online, within the piped latency bounds. */
+    void set_adaptive_pipeline(bool adaptive_pipeline);
+
+    /** Call to only verify the aggregate of the child votes. */
+    void set_optimistic_verify(bool optimistic_verify);
+
+    /** Call to set the minimal aggregation deadline of internal nodes. */
+    void set_agg_timeout(double agg_timeout);
+
+    /** Call to set how long the root waits for a QC before changing the tree. */
+    void set_reconfig_timeout(double reconfig_timeout);
+
+    /** Call to build the tree from measured round-trip times. */
+    void set_latency_tree(bool latency_tree);
+
+    /** Call to set the number of disjoint dissemination trees. */
+    void set_ntrees(int32_t ntrees);
+
 
     /* TODO: better name for "delivery" ? */
     /** Call to inform the state machine that a block is ready to be handled.
@@ -146,11 +255,11 @@ public:
      * functions should be implemented by the user to specify the behavior upon
      * the events. */
 
-    // Pipelined block hash.
-    std::deque<uint256_t> piped_queue;
+    // Pipelined blocks.
+    PipelineWindow piped_window;
 
-    // Pipelined block hash.
-    std::deque<uint256_t> rdy_queue;
+    // Measures the QC latency, tunes the pipeline if adaptive_pipeline is set.
+    PipelineController pipe_ctl;
 
     // Last regular block height.
     int b_normal_height = 0;
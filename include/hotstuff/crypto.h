@@ -17,6 +17,8 @@
 #ifndef _HOTSTUFF_CRYPTO_H
 #define _HOTSTUFF_CRYPTO_H
 
+#include <list>
+#include <mutex>
 #include <openssl/rand.h>
 
 #include "secp256k1.h"
@@ -64,6 +66,8 @@ class QuorumCert: public Serializable, public Cloneable {
     virtual void add_part(const ReplicaConfig &config, ReplicaID replica, const PartCert &pc) = 0;
     virtual void merge_quorum(const QuorumCert &qc) = 0;
     virtual bool has_n(uint32_t n) = 0;
+    /** Whether the part of `replica` is already in. */
+    virtual bool has_part(ReplicaID replica) const = 0;
     virtual void compute() = 0;
     virtual promise_t verify(const ReplicaConfig &config, VeriPool &vpool) = 0;
     virtual bool verify(const ReplicaConfig &config) = 0;
@@ -206,6 +210,7 @@ class QuorumCertDummy: public QuorumCert {
     {
         return qty >= n;
     }
+    bool has_part(ReplicaID) const override { return false; }
     void compute() override {}
     bool verify(const ReplicaConfig &) override { return true; }
     promise_t verify(const ReplicaConfig &, VeriPool &) override {
@@ -510,6 +515,10 @@ class QuorumCertSecp256k1: public QuorumCert {
         return sigs.size() >= n;
     }
 
+    bool has_part(ReplicaID rid) const override {
+        return sigs.count(rid);
+    }
+
     void compute() override {}
 
     bool verify(const ReplicaConfig &config) override;
@@ -534,12 +543,38 @@ class QuorumCertSecp256k1: public QuorumCert {
     }
 };
 
+    /** Messages (block hashes) mapped to G2, shared by all verifying threads
+     * so that hash-to-curve runs once per block rather than per signature. */
+    class MsgHashCacheBLS {
+        size_t max_entries;
+        std::mutex cache_lock;
+        /** insertion order, the oldest entry is evicted when full */
+        std::list<uint256_t> order;
+        /** the mapped point and the position of the message in `order` */
+        std::unordered_map<uint256_t,
+            std::pair<bls::G2Element, std::list<uint256_t>::iterator>> cache;
+
+    public:
+        MsgHashCacheBLS(size_t max_entries = 1024): max_entries(max_entries) {}
+
+        bls::G2Element get(const uint256_t &msg);
+        /** Drop the mapped point once the block is pruned. */
+        void erase(const uint256_t &msg);
+    };
+
+    extern MsgHashCacheBLS bls_msg_hash_cache;
+
+    /** PopSchemeMPL::Verify with the mapped message taken from bls_msg_hash_cache. */
+    bool verify_bls(const bls::G1Element &pub, const uint256_t &msg, const bls::G2Element &sig);
+
     class PrivKeyBLS;
     class PubKeyBLS: public PubKey {
         static const auto _olen = bls::G1Element::SIZE;
         friend class SigSecBLS;
         friend class SigSecBLSAgg;
         friend class QuorumCertAggBLS;
+        friend class PubKeyAggCacheBLS;
+        friend class SigVeriTaskBLS;
 
         bls::G1Element* data = nullptr;
 
@@ -728,7 +763,7 @@ class QuorumCertSecp256k1: public QuorumCert {
 
             //struct timeval timeStart, timeEnd;
             //gettimeofday(&timeStart, nullptr);
-            bool td = bls::PopSchemeMPL::Verify(*(pub_key.data), arrToVec(msg), *data);
+            bool td = verify_bls(*(pub_key.data), uint256_t(msg), *data);
 
             /*gettimeofday(&timeEnd, nullptr);
 
@@ -741,15 +776,30 @@ class QuorumCertSecp256k1: public QuorumCert {
         }
     };
 
-    class SigVeriTaskBLS: public VeriTask {
+    /** BLS checks on the same message, batched by a random linear combination. */
+    class SigVeriTaskBLSBatch: public BatchVeriTask {
+    protected:
         uint256_t msg;
+        virtual const bls::G1Element &get_pub() const = 0;
+        virtual const bls::G2Element &get_sig() const = 0;
+    public:
+        SigVeriTaskBLSBatch(const uint256_t &msg): msg(msg) {}
+
+        const uint256_t &get_msg() const override { return msg; }
+        bool verify_batch(const std::vector<BatchVeriTask *> &batch) override;
+    };
+
+    class SigVeriTaskBLS: public SigVeriTaskBLSBatch {
         PubKeyBLS pubkey;
         SigSecBLS sig;
+    protected:
+        const bls::G1Element &get_pub() const override { return *pubkey.data; }
+        const bls::G2Element &get_sig() const override { return *sig.data; }
     public:
         SigVeriTaskBLS(const uint256_t &msg,
                           const PubKeyBLS &pubkey,
                           const SigSecBLS &sig):
-                msg(msg), pubkey(pubkey), sig(sig) {}
+                SigVeriTaskBLSBatch(msg), pubkey(pubkey), sig(sig) {}
         virtual ~SigVeriTaskBLS() = default;
 
         bool verify() override {
@@ -872,7 +922,7 @@ class QuorumCertSecp256k1: public QuorumCert {
             struct timeval timeStart, timeEnd;
             gettimeofday(&timeStart, nullptr);
 
-            bool td = bls::PopSchemeMPL::Verify(*(pub_key.data), arrToVec(msg), *data);
+            bool td = verify_bls(*(pub_key.data), uint256_t(msg), *data);
 
             gettimeofday(&timeEnd, nullptr);
 
@@ -885,15 +935,18 @@ class QuorumCertSecp256k1: public QuorumCert {
         }
     };
 
-    class SigVeriTaskBLSAgg: public VeriTask {
-        uint256_t msg;
-        vector<bls::G1Element> pubs;
+    class SigVeriTaskBLSAgg: public SigVeriTaskBLSBatch {
+        /** public keys of all signers, already aggregated */
+        bls::G1Element pub;
         SigSecBLSAgg sig;
+    protected:
+        const bls::G1Element &get_pub() const override { return pub; }
+        const bls::G2Element &get_sig() const override { return *sig.data; }
     public:
-        SigVeriTaskBLSAgg(uint256_t msg,
-                          vector<bls::G1Element> pubs,
+        SigVeriTaskBLSAgg(const uint256_t &msg,
+                          const bls::G1Element &pub,
                           const SigSecBLSAgg &sig):
-                msg(std::move(msg)), pubs(std::move(pubs)), sig(sig) {}
+                SigVeriTaskBLSBatch(msg), pub(pub), sig(sig) {}
         virtual ~SigVeriTaskBLSAgg() = default;
 
         bool verify() override {
@@ -901,7 +954,7 @@ class QuorumCertSecp256k1: public QuorumCert {
             //struct timeval timeStart, timeEnd;
             //gettimeofday(&timeStart, nullptr);
 
-            bool valid = bls::PopSchemeMPL::FastAggregateVerify(pubs, arrToVec(msg.to_bytes()), *sig.data);
+            bool valid = verify_bls(pub, msg, *sig.data);
 
             //gettimeofday(&timeEnd, nullptr);
 
@@ -952,17 +1005,49 @@ class QuorumCertSecp256k1: public QuorumCert {
     };
 
 
+    /** Cache of aggregated BLS public keys keyed by the signer bitmap of a
+     * quorum certificate. It is seeded with the aggregate of every subtree of
+     * the dissemination tree, so a bitmap missing a few signers of a subtree
+     * only costs a few subtractions. Only used from the event loop thread. */
+    class PubKeyAggCacheBLS {
+        static const size_t max_entries = 4096;
+        std::unordered_map<std::string, bls::G1Element> cache;
+        std::vector<std::pair<salticidae::Bits, bls::G1Element>> seeds;
+
+        static std::string get_key(const salticidae::Bits &rids);
+        static const bls::G1Element &get_pub(const ReplicaConfig &config, ReplicaID rid);
+
+    public:
+        /** Precompute the aggregate for the given signer set. */
+        void seed(const ReplicaConfig &config, const salticidae::Bits &rids);
+        /** Get the aggregated public key of the signers in the bitmap. */
+        bls::G1Element get(const ReplicaConfig &config, const salticidae::Bits &rids);
+
+        void clear() {
+            cache.clear();
+            seeds.clear();
+        }
+    };
+
     class QuorumCertAggBLS: public QuorumCert {
         uint256_t obj_hash;
         salticidae::Bits rids;
+        /** running aggregate of all the parts added so far */
         SigSecBLSAgg* theSig = nullptr;
-        vector<bls::G2Element> sigs;
         uint32_t n = 0;
 
+        /** Fold a signature into the running aggregate. */
+        void aggregate(const bls::G2Element &sig) {
+            if (theSig == nullptr)
+                theSig = new SigSecBLSAgg(sig);
+            else
+                *theSig->data = *theSig->data + sig;
+        }
+
     public:
         QuorumCertAggBLS() = default;
         QuorumCertAggBLS(const ReplicaConfig &config, const uint256_t &obj_hash);
-        QuorumCertAggBLS (const QuorumCertAggBLS &other): obj_hash(other.obj_hash), rids(other.rids)
+        QuorumCertAggBLS (const QuorumCertAggBLS &other): obj_hash(other.obj_hash), rids(other.rids), n(other.n)
         {
             if (other.theSig != nullptr) {
                 theSig = new SigSecBLSAgg(*other.theSig);
@@ -987,79 +1072,34 @@ class QuorumCertSecp256k1: public QuorumCert {
         void add_part(const ReplicaConfig &config, ReplicaID rid, const PartCert &pc) override {
             if (pc.get_obj_hash() != obj_hash)
                 throw std::invalid_argument("PartCert does match the block hash");
+            /* folding the same signer twice would break the aggregate */
+            if (rids.get(rid)) return;
             rids.set(rid);
-            calculateN();
-
-            //if (theSig == nullptr) {
-            //    theSig = new SigSecBLSAgg(*dynamic_cast<const PartCertBLSAgg &>(pc).data);
-            //    sigs.push_back(*theSig->data);
-            //    return;
-            //}
-            if (sigs.empty() && theSig != nullptr) {
-                sigs.push_back(*theSig->data);
-                delete theSig;
-                theSig = nullptr;
-            }
-            sigs.push_back(*dynamic_cast<const SigSecBLSAgg &>(pc).data);
-            //bls::G2Element sig1 = *theSig->data;
-            //bls::G2Element sig2 = *dynamic_cast<const SigSecBLSAgg &>(pc).data;
-
-            //struct timeval timeStart, timeEnd;
-            //gettimeofday(&timeStart, nullptr);
-
-            //bls::G2Element sig = bls::PopSchemeMPL::Aggregate({sig1, sig2});
-
-            //gettimeofday(&timeEnd, nullptr);
-
-            //std::cout << "Aggregating Sigs: "
-            //          << ((timeEnd.tv_sec - timeStart.tv_sec) * 1000000 + timeEnd.tv_usec - timeStart.tv_usec)
-            //          << " us to execute."
-            //          << std::endl;
-
-            //*theSig->data = sig;
+            n++;
+            aggregate(*dynamic_cast<const SigSecBLSAgg &>(pc).data);
         }
 
         void merge_quorum(const QuorumCert &qc) override {
             if (qc.get_obj_hash()!= obj_hash) throw std::invalid_argument("QuorumCert does match the block hash");
 
-            salticidae::Bits newRids = dynamic_cast<const QuorumCertAggBLS &>(qc).rids;
+            const auto &other = dynamic_cast<const QuorumCertAggBLS &>(qc);
+            if (other.theSig == nullptr) return;
+
+            const salticidae::Bits &newRids = other.rids;
+            for (unsigned int i = 0;i < newRids.size();i++) {
+                if (newRids[i] == 1 && rids.get(i)) {
+                    HOTSTUFF_LOG_WARN("overlapping quorum cert for %s, not merged",
+                                      get_hex10(obj_hash).c_str());
+                    return;
+                }
+            }
             for (unsigned int i = 0;i < newRids.size();i++) {
                 if (newRids[i] == 1) {
                     rids.set(i);
+                    n++;
                 }
             }
-            calculateN();
-
-            if (sigs.empty() && theSig != nullptr) {
-                sigs.push_back(*theSig->data);
-                delete theSig;
-                theSig = nullptr;
-            }
-
-            for (bls::G2Element el : dynamic_cast<const QuorumCertAggBLS &>(qc).sigs) {
-                sigs.push_back(el);
-            }
-
-            if (dynamic_cast<const QuorumCertAggBLS &>(qc).theSig != nullptr) {
-                sigs.push_back(*dynamic_cast<const QuorumCertAggBLS &>(qc).theSig->data);
-            }
-
-            //bls::G2Element sig1 = *theSig->data;
-            //bls::G2Element sig2 = *dynamic_cast<const QuorumCertAggBLS &>(qc).theSig->data;
-
-            //struct timeval timeStart,timeEnd;
-            //gettimeofday(&timeStart, nullptr);
-
-            //bls::G2Element sig = bls::PopSchemeMPL::Aggregate({sig1, sig2});
-
-            //gettimeofday(&timeEnd, nullptr);
-
-            //std::cout << "Aggregating Sigs: "
-            //          << ((timeEnd.tv_sec - timeStart.tv_sec) * 1000000 + timeEnd.tv_usec - timeStart.tv_usec)
-            //          << " us to execute."
-            //          << std::endl;
-
-            //*theSig->data = sig;
+            aggregate(*other.theSig->data);
         }
 
         bool has_n(const uint32_t t) override {
@@ -1067,23 +1107,13 @@ class QuorumCertSecp256k1: public QuorumCert {
             return n >= t;
         }
 
-        void compute() override {
-            if (theSig == nullptr) {
-                struct timeval timeStart,timeEnd;
-                gettimeofday(&timeStart, nullptr);
-
-                theSig = new SigSecBLSAgg(bls::PopSchemeMPL::Aggregate(sigs));
-                sigs.clear();
-
-                gettimeofday(&timeEnd, nullptr);
-
-                std::cout << "Aggregating Sigs: "
-                          << ((timeEnd.tv_sec - timeStart.tv_sec) * 1000000 + timeEnd.tv_usec - timeStart.tv_usec)
-                          << " us to execute."
-                          << std::endl;
-            }
+        bool has_part(ReplicaID rid) const override {
+            return rid < rids.size() && rids.get(rid);
         }
 
+        /** The parts are aggregated as they arrive, nothing left to do. */
+        void compute() override {}
+
         bool verify(const ReplicaConfig &config) override;
         promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
 
@@ -1096,12 +1126,7 @@ class QuorumCertSecp256k1: public QuorumCert {
         void serialize(DataStream &s) const override {
             bool combined = (theSig != nullptr);
             s << obj_hash << rids << combined;
-            if (combined) {
-                if (theSig == nullptr || !sigs.empty()) {
-                    throw std::runtime_error("sigs not aggregated before sending!");
-                }
-                theSig->serialize(s);
-            }
+            if (combined) theSig->serialize(s);
         }
 
         void unserialize(DataStream &s) override {
@@ -66,8 +66,24 @@ class ReplicaConfig {
     int32_t fanout;
     int32_t piped_latency;
     int32_t async_blocks;
-
-    ReplicaConfig(): nreplicas(0), nmajority(0) {}
+    /** retune async_blocks and piped_latency from the measured QC latency,
+     * taking the given values as bounds */
+    bool adaptive_pipeline;
+    /** aggregate child votes before verifying them (at internal nodes) */
+    bool optimistic_verify;
+    /** lower bound (in seconds) of the aggregation deadline at internal nodes, 0 to wait for the whole subtree */
+    double agg_timeout;
+    /** seconds without a new QC before the root changes the tree, 0 to never change it */
+    double reconfig_timeout;
+    /** measure round-trip times at start and switch to a latency-aware tree */
+    bool latency_tree;
+    /** number of disjoint dissemination trees used in turn */
+    int32_t ntrees;
+
+    /** aggregated BLS public keys of frequently seen signer sets */
+    mutable PubKeyAggCacheBLS pubkey_agg_cache;
+
+    ReplicaConfig(): nreplicas(0), nmajority(0), adaptive_pipeline(false), optimistic_verify(false), agg_timeout(0), reconfig_timeout(0), latency_tree(false), ntrees(1) {}
 
     void add_replica(ReplicaID rid, const ReplicaInfo &info) {
         replica_map.insert(std::make_pair(rid, info));
@@ -138,6 +154,9 @@ class Block {
     uint32_t height;
     bool delivered;
     int8_t decision;
+    /** the dissemination tree the block went through (not serialized),
+     * UINT8_MAX if it did not come through one */
+    uint8_t tree;
 
     std::unordered_set<ReplicaID> voted;
 
@@ -146,14 +165,14 @@ class Block {
         qc(nullptr),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(false), decision(0) {}
+        delivered(false), decision(0), tree(UINT8_MAX) {}
 
     Block(bool delivered, int8_t decision):
         qc(new QuorumCertDummy()),
         hash(salticidae::get_hash(*this)),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(delivered), decision(decision) {}
+        delivered(delivered), decision(decision), tree(UINT8_MAX) {}
 
     Block(const std::vector<block_t> &parents,
         const std::vector<uint256_t> &cmds,
@@ -173,7 +192,8 @@ class Block {
             self_qc(std::move(self_qc)),
             height(height),
             delivered(0),
-            decision(decision) {}
+            decision(decision),
+            tree(UINT8_MAX) {}
 
     void serialize(DataStream &s) const;
 
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_ERASURE_H
+#define _HOTSTUFF_ERASURE_H
+
+#include <map>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Systematic Reed-Solomon code over GF(2^8): the data is cut into `k`
+ * fragments and `n - k` parity fragments are added, any `k` of the `n`
+ * fragments recover the data. */
+class ReedSolomon {
+    size_t k, n;
+    /** the `n` x `k` encoding matrix, identity on top of a Cauchy matrix */
+    std::vector<uint8_t> matrix;
+
+    public:
+    ReedSolomon(size_t k, size_t n);
+
+    size_t get_k() const { return k; }
+    size_t get_n() const { return n; }
+
+    /** Returns the `n` fragments of `size` bytes of data. */
+    std::vector<bytearray_t> encode(const uint8_t *data, size_t size) const;
+    /** Recovers the first `size` bytes of data from at least `k` fragments,
+     * indexed by their position in the encoding. */
+    bytearray_t decode(const std::map<uint32_t, bytearray_t> &frags, size_t size) const;
+};
+
+/** Merkle tree over fragments, the last node of an odd level is paired with
+ * itself. */
+struct MerkleTree {
+    /** Returns the root and fills in the proof of every leaf. */
+    static uint256_t build(const std::vector<bytearray_t> &leaves,
+                            std::vector<std::vector<uint256_t>> &proofs);
+    /** Checks that `leaf` is at position `idx` under `root`. */
+    static bool verify(const uint256_t &root, const bytearray_t &leaf,
+                        size_t idx, const std::vector<uint256_t> &proof);
+    /** Returns the number of hashes in every proof of a tree with `nleaves`
+     * leaves. */
+    static size_t proof_size(size_t nleaves);
+};
+
+}
+
+#endif
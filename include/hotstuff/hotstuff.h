@@ -18,7 +18,11 @@
 #ifndef _HOTSTUFF_CORE_H
 #define _HOTSTUFF_CORE_H
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <queue>
+#include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -27,6 +31,8 @@
 #include "salticidae/msg.h"
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
+#include "hotstuff/topology.h"
+#include "hotstuff/erasure.h"
 
 namespace hotstuff {
 
@@ -37,17 +43,44 @@ using salticidae::_2;
 
 const double ent_waiting_timeout = 10;
 const double double_inf = 1e10;
+/** incomplete chunked proposals kept before the oldest is dropped */
+const size_t max_chunk_assemblies = 64;
+/** erasure-coded proposals tracked before the oldest is dropped */
+const size_t max_fragment_assemblies = 64;
+/** unknown blocks with early votes held before the oldest is dropped */
+const size_t max_parked_blks = 64;
+/** seconds to wait for a batch from its worker before asking the proposer */
+const double batch_fetch_delay = 0.1;
+/** decided batches are kept this many heights for the replicas behind */
+const uint32_t batch_keep_depth = 100;
+/** blocks this many heights below the newest one lose their partial
+ * aggregation state */
+const uint32_t agg_state_depth = 100;
+/** seconds between two checks of the connections to the tree neighbours */
+const double ready_poll_interval = 0.01;
+/** seconds after which an unused connection to a non-neighbour is closed */
+const double idle_conn_timeout = 60;
+/** seconds a replica collects client commands before forwarding them to
+ * the proposer */
+const double cmd_forward_delay = 0.005;
 
 /** Network message format for HotStuff. */
 struct MsgPropose {
     static const opcode_t opcode = 0x0;
     DataStream serialized;
+    /** the tree carrying the proposal, read by the receiver before relaying */
+    uint8_t tree;
     Proposal proposal;
-    MsgPropose(const Proposal &);
+    /** read by pre_parse, waiting to be added to the storage */
+    ReplicaID proposer;
+    Block blk;
+    bool pre_parsed;
+    MsgPropose(const Proposal &, uint8_t tree = 0);
     /** Only move the data to serialized, do not parse immediately. */
-    MsgPropose(DataStream &&s): serialized(std::move(s)) {}
-    MsgPropose(DataStream stream, bool wut): serialized(std::move(stream)) {}
+    MsgPropose(DataStream &&s): serialized(std::move(s)), pre_parsed(false) {}
 
+    /** Deserialize without touching `hsc->storage` (safe off the event loop). */
+    void pre_parse(HotStuffCore *hsc);
     /** Parse the serialized data to blks now, with `hsc->storage`. */
     void postponed_parse(HotStuffCore *hsc);
 };
@@ -74,8 +107,13 @@ struct MsgRespBlock {
     static const opcode_t opcode = 0x3;
     DataStream serialized;
     std::vector<block_t> blks;
+    /** read by pre_parse, waiting to be added to the storage */
+    std::vector<Block> parsed_blks;
+    bool pre_parsed;
     MsgRespBlock(const std::vector<block_t> &blks);
-    MsgRespBlock(DataStream &&s): serialized(std::move(s)) {}
+    MsgRespBlock(DataStream &&s): serialized(std::move(s)), pre_parsed(false) {}
+    /** Deserialize without touching `hsc->storage` (safe off the event loop). */
+    void pre_parse(HotStuffCore *hsc);
     void postponed_parse(HotStuffCore *hsc);
 };
 
@@ -83,11 +121,138 @@ struct MsgRelay {
     static const opcode_t opcode = 0x4;
     DataStream serialized;
     VoteRelay vote;
+    bool pre_parsed;
     MsgRelay(const VoteRelay &);
-    MsgRelay(DataStream &&s): serialized(std::move(s)) {}
+    MsgRelay(DataStream &&s): serialized(std::move(s)), pre_parsed(false) {}
+    /** Deserialize the certificate (safe off the event loop). */
+    void pre_parse(HotStuffCore *hsc);
     void postponed_parse(HotStuffCore *hsc);
 };
 
+struct MsgReconfig {
+    static const opcode_t opcode = 0x5;
+    DataStream serialized;
+    /** the tree to switch to */
+    uint32_t epoch;
+    /** epoch the topology was installed at, the rotation counts from it */
+    uint32_t base_epoch;
+    /** height of the highest certified block, later blocks are voted again */
+    uint32_t height;
+    /** measured round-trip times, when switching to a latency-aware tree */
+    std::vector<uint32_t> rtts;
+    MsgReconfig(uint32_t epoch, uint32_t base_epoch, uint32_t height,
+                const std::vector<uint32_t> &rtts = std::vector<uint32_t>());
+    MsgReconfig(DataStream &&s);
+};
+
+struct MsgPing {
+    static const opcode_t opcode = 0x6;
+    DataStream serialized;
+    /** send time at the pinging replica, in microseconds */
+    uint64_t ts;
+    MsgPing(uint64_t ts);
+    MsgPing(DataStream &&s);
+};
+
+struct MsgPong {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    uint64_t ts;
+    MsgPong(uint64_t ts);
+    MsgPong(DataStream &&s);
+};
+
+struct MsgRttReport {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    /** round-trip time to every replica in microseconds, UINT32_MAX if unknown */
+    std::vector<uint32_t> rtts;
+    MsgRttReport(const std::vector<uint32_t> &rtts);
+    MsgRttReport(DataStream &&s);
+};
+
+/** A piece of a proposal, relayed as soon as it arrives. */
+struct MsgProposeChunk {
+    static const opcode_t opcode = 0x9;
+    DataStream serialized;
+    uint8_t tree;
+    /** hash of the whole serialized proposal */
+    uint256_t digest;
+    uint32_t idx;
+    uint32_t nchunks;
+    MsgProposeChunk(uint8_t tree, const uint256_t &digest,
+                    uint32_t idx, uint32_t nchunks,
+                    const uint8_t *begin, const uint8_t *end);
+    /** Only move the data to serialized, do not parse immediately. */
+    MsgProposeChunk(DataStream &&s): serialized(std::move(s)) {}
+
+    /** Read the header, leaving the chunk data in serialized. */
+    void parse_header();
+};
+
+/** A coded fragment of a proposal with its Merkle proof. */
+struct Fragment {
+    uint32_t idx;
+    bytearray_t data;
+    std::vector<uint256_t> proof;
+};
+
+struct MsgFragments {
+    static const opcode_t opcode = 0xa;
+    DataStream serialized;
+    uint8_t tree;
+    /** handed down the tree by the parent, rather than echoed by a peer */
+    bool relay;
+    /** hash of the whole serialized proposal */
+    uint256_t digest;
+    /** Merkle root of all fragments */
+    uint256_t root;
+    /** size of the serialized proposal */
+    uint32_t size;
+    std::vector<Fragment> frags;
+    MsgFragments(uint8_t tree, bool relay, const uint256_t &digest,
+                const uint256_t &root, uint32_t size,
+                const std::vector<Fragment> &frags);
+    MsgFragments(DataStream &&s);
+};
+
+/** A batch of commands, the blocks only carry its digest. */
+struct MsgBatch {
+    static const opcode_t opcode = 0xb;
+    DataStream serialized;
+    /** the receiver is the worker of the batch and passes it on to everybody */
+    bool relay;
+    std::vector<uint256_t> cmds;
+    MsgBatch(bool relay, const std::vector<uint256_t> &cmds);
+    MsgBatch(DataStream &&s);
+};
+
+struct MsgReqBatch {
+    static const opcode_t opcode = 0xc;
+    DataStream serialized;
+    std::vector<uint256_t> digests;
+    MsgReqBatch(const std::vector<uint256_t> &digests);
+    MsgReqBatch(DataStream &&s);
+};
+
+/** Several messages to the same replica sent as one frame, each entry is
+ * the opcode, the length and the payload of a message. */
+struct MsgBundle {
+    static const opcode_t opcode = 0xd;
+    DataStream serialized;
+    MsgBundle(DataStream &&s): serialized(std::move(s)) {}
+};
+
+/** Client commands a replica passes on to the proposer. */
+struct MsgForwardCmds {
+    static const opcode_t opcode = 0xe;
+    DataStream serialized;
+    std::vector<uint256_t> cmds;
+    std::vector<uint32_t> sizes;
+    MsgForwardCmds(const std::vector<uint256_t> &cmds, const std::vector<uint32_t> &sizes);
+    MsgForwardCmds(DataStream &&s);
+};
+
 using promise::promise_t;
 
 class HotStuffBase;
@@ -146,8 +311,10 @@ class HotStuffBase: public HotStuffCore {
     protected:
     /** the binding address in replica network */
     NetAddr listen_addr;
-    /** the block size */
+    /** the block size, tuned between the bounds below if the maximum is set */
     size_t blk_size;
+    size_t blk_size_min;
+    size_t blk_size_max;
     /** libevent handle */
     EventContext ec;
     salticidae::ThreadCall tcall;
@@ -159,6 +326,9 @@ class HotStuffBase: public HotStuffCore {
     bool ec_loop;
     /** network stack */
     Net pn;
+    /** a second connection to every replica for votes and relays, so that
+     * they never wait behind a block on the same connection */
+    Net pn_ctl;
     std::unordered_set<uint256_t> valid_tls_certs;
 #ifdef HOTSTUFF_BLK_PROFILE
     BlockProfiler blk_profiler;
@@ -167,11 +337,186 @@ class HotStuffBase: public HotStuffCore {
     /* queues for async tasks */
     std::unordered_map<const uint256_t, BlockFetchContext> blk_fetch_waiting;
     std::unordered_map<const uint256_t, BlockDeliveryContext> blk_delivery_waiting;
+    /** votes and relays that overtook their proposal wait here for the block */
+    std::unordered_map<const uint256_t, promise_t> blk_arrival_waiting;
+    std::deque<uint256_t> blk_arrival_order;
     std::unordered_map<const uint256_t, commit_cb_t> decision_waiting;
-    using cmd_queue_t = salticidae::MPSCQueueEventDriven<std::pair<uint256_t, commit_cb_t>>;
+    /** a command submitted to the proposer */
+    struct PendingCmd {
+        uint256_t cmd_hash;
+        commit_cb_t callback;
+        size_t size;
+    };
+    using cmd_queue_t = salticidae::MPSCQueueEventDriven<PendingCmd>;
     cmd_queue_t cmd_pending;
     std::vector<uint256_t> cmd_pending_buffer;
     std::vector<uint256_t> final_buffer;
+    /** bytes of the commands in cmd_pending_buffer */
+    size_t cmd_pending_bytes;
+    /** a block is also cut at this many command bytes (0 to disable) */
+    size_t blk_bytes;
+    /** or once its oldest command waited this many seconds (0 to disable) */
+    double blk_deadline;
+    TimerEvent blk_cut_timer;
+    /** when the oldest command in cmd_pending_buffer arrived (in us) */
+    uint64_t cmd_pending_since;
+    /** commands submitted but not yet taken from cmd_pending */
+    std::atomic<size_t> cmd_backlog;
+    /** commands to forward to the proposer, with their sizes */
+    std::vector<uint256_t> fwd_cmds;
+    std::vector<uint32_t> fwd_sizes;
+    TimerEvent fwd_timer;
+    /** a proposal already relayed but not yet parsed */
+    struct PendingProposal {
+        PeerId peer;
+        uint8_t tree;
+        DataStream serialized;
+    };
+    using prop_queue_t = salticidae::MPSCQueueEventDriven<PendingProposal>;
+    prop_queue_t prop_pending;
+    /** proposals larger than this are sent in chunks (0 to disable) */
+    size_t chunk_size;
+    /** chunks of the largest proposal accepted */
+    size_t max_nchunks;
+    /** the chunks of a proposal received so far */
+    struct ChunkAssembly {
+        std::vector<bytearray_t> chunks;
+        std::vector<bool> received;
+        uint32_t nreceived = 0;
+    };
+    std::unordered_map<const uint256_t, ChunkAssembly> chunk_assemblies;
+    std::deque<uint256_t> chunk_order;
+    /** whether proposals are erasure-coded across the replicas */
+    bool erasure_coding;
+    BoxObj<ReedSolomon> rs;
+    /** the fragments of a proposal received so far */
+    struct FragmentAssembly {
+        uint8_t tree;
+        std::map<uint32_t, bytearray_t> frags;
+        bool done = false;
+    };
+    /** by the hash of the Merkle root, the digest and the size */
+    std::unordered_map<const uint256_t, FragmentAssembly> fragment_assemblies;
+    std::deque<uint256_t> fragment_order;
+    /** sends every child the fragments of its subtree */
+    void send_fragments(uint8_t tree, const uint256_t &digest, const uint256_t &root,
+                        uint32_t size, const std::vector<Fragment> &frags);
+    /** commands per batch, blocks list batch digests instead of commands
+     * (0 to disable) */
+    size_t batch_size;
+    std::unordered_map<const uint256_t, std::vector<uint256_t>> batches;
+    /** the decided batches by height, the oldest are dropped */
+    std::deque<std::pair<uint32_t, uint256_t>> decided_batches;
+    /** commands decided so far in the batches of the latest decided block */
+    uint256_t batch_offset_blk;
+    uint32_t batch_cmd_offset;
+    /** the worker of the next batch, the rotation goes on across blocks */
+    size_t batch_worker;
+    struct BatchFetch {
+        promise_t pm;
+        TimerEvent timer;
+        /** requests sent so far */
+        size_t nasked;
+        BatchFetch(): pm([](promise_t) {}), nasked(0) {}
+    };
+    std::unordered_map<const uint256_t, BatchFetch> batch_waiting;
+    /** hands the batches of `cmds` to the replicas and returns their digests */
+    std::vector<uint256_t> disseminate_batches(std::vector<uint256_t> &&cmds);
+    /** Returns a promise resolved when the batch is available. */
+    promise_t async_fetch_batch(const uint256_t &digest, const PeerId &replica);
+
+    /** seconds to hold outgoing votes and relays for coalescing, 0 for the
+     * rest of the event-loop iteration (negative to disable) */
+    double coalesce_window;
+    std::unordered_map<const PeerId, DataStream> outboxes;
+    TimerEvent coalesce_timer;
+    bool coalesce_armed;
+    using bundled_handler_t = std::function<void(DataStream &&, const Net::conn_t &)>;
+    std::unordered_map<opcode_t, bundled_handler_t> bundled_handlers;
+    /** the port of the vote lane is the replica port plus this offset
+     * (0 to share the connection with the blocks) */
+    uint16_t ctl_port_offset;
+
+    Net &ctl_net() { return ctl_port_offset ? pn_ctl : pn; }
+    NetAddr ctl_addr(const NetAddr &addr) const {
+        return NetAddr(addr.ip, htons(ntohs(addr.port) + ctl_port_offset));
+    }
+
+    /** resolved once the parent and the children in every tree are
+     * connected, proposing waits for it */
+    promise_t ready;
+    bool is_ready;
+    bool beat_deferred;
+    /** tree neighbours not connected yet */
+    std::vector<PeerId> unready_neighbours;
+    TimerEvent ready_timer;
+    void check_ready();
+
+    /** connect to the tree neighbours only, to the others on demand */
+    bool sparse_mesh;
+    std::unordered_map<const PeerId, NetAddr> peer_addrs;
+    /** connections known to be up, with the time they were last used */
+    std::unordered_map<const PeerId, uint64_t> live_peers;
+    /** connections being opened on demand and the messages waiting for them */
+    std::unordered_map<const PeerId, std::vector<std::function<void()>>> lazy_pending;
+    TimerEvent lazy_timer;
+    bool lazy_armed;
+    TimerEvent reap_timer;
+    bool is_neighbour(const PeerId &peer) const;
+    /** whether `peer` can be sent to now, opens the connection otherwise */
+    bool lazy_ready(const PeerId &peer);
+    void on_lazy_timer();
+    void reap_idle_conns();
+
+    /** sends `msg` to `peer`, which may not be a tree neighbour */
+    template<typename M>
+    void send_lazy(const M &msg, const PeerId &peer) {
+        if (lazy_ready(peer))
+            pn.send_msg(msg, peer);
+        else
+            lazy_pending[peer].push_back([this, msg, peer]() { pn.send_msg(msg, peer); });
+    }
+
+    template<typename M>
+    void multicast_lazy(const M &msg, const std::vector<PeerId> &dests) {
+        std::vector<PeerId> now;
+        for (const auto &peer: dests)
+        {
+            if (lazy_ready(peer))
+                now.push_back(peer);
+            else
+                lazy_pending[peer].push_back([this, msg, peer]() { pn.send_msg(msg, peer); });
+        }
+        if (!now.empty()) pn.multicast_msg(msg, now);
+    }
+
+    /** sends `msg` to `peer`, in a bundle with the other messages to
+     * `peer` when coalescing */
+    template<typename M>
+    void send_coalesced(M &&msg, const PeerId &peer) {
+        if (coalesce_window < 0)
+        {
+            ctl_net().send_msg(std::move(msg), peer);
+            return;
+        }
+        auto &out = outboxes[peer];
+        out << M::opcode << htole((uint32_t)msg.serialized.size());
+        out.put_data(msg.serialized.data(), msg.serialized.data() + msg.serialized.size());
+        if (!coalesce_armed)
+        {
+            coalesce_armed = true;
+            coalesce_timer.add(coalesce_window);
+        }
+    }
+    void flush_outboxes();
+
+    /** lets the handler of `M` take the messages of this type in a bundle */
+    template<typename M>
+    void reg_bundled_handler(void (HotStuffBase::*handler)(M &&, const Net::conn_t &)) {
+        bundled_handlers[M::opcode] = [this, handler](DataStream &&s, const Net::conn_t &conn) {
+            (this->*handler)(M(std::move(s)), conn);
+        };
+    }
 
     /* statistics */
     uint64_t fetched;
@@ -189,23 +534,170 @@ class HotStuffBase: public HotStuffCore {
     mutable double part_delivery_time_max;
     mutable std::unordered_map<const PeerId, uint32_t> part_fetched_replica;
 
-    mutable PeerId parentPeer;
-    mutable std::set<PeerId> childPeers;
+    /** this replica's place in one dissemination tree */
+    struct TreeView {
+        PeerId parent;
+        std::set<PeerId> children;
+        /** size of the subtree below this replica */
+        uint16_t ndescendants = 0;
+        /** the replicas below every child, the child included */
+        std::map<PeerId, std::vector<ReplicaID>> child_subtree;
+    };
+    /** disjoint trees, the proposer picks one for every block */
+    std::vector<TreeView> trees;
+
+    const TreeView &tree_of(const block_t &blk) const { return tree_of(trees, blk); }
+    static const TreeView &tree_of(const std::vector<TreeView> &views, const block_t &blk) {
+        if (blk->tree < views.size()) return views[blk->tree];
+        /* fetched: the proposer sent it over the tree of its height */
+        return views[blk->is_delivered() ? blk->get_height() % views.size() : 0];
+    }
+
+    /** child votes aggregated without individual verification */
+    struct OptimisticVotes {
+        uint32_t height;
+        std::vector<Vote> votes;
+    };
+    std::unordered_map<const uint256_t, OptimisticVotes> optimistic_votes;
+    /** at the root, the certificates started over by a tree switch: the kept
+     * self_qc only takes the aggregates that do not overlap it, this one
+     * takes the new tree's, and the first to get a quorum is used */
+    std::unordered_map<const uint256_t, quorum_cert_bt> restarted_qcs;
+    /** uses the restarted certificate of `blk` if it got a quorum first */
+    void settle_restarted_qc(const block_t &blk);
+
+    /** whether the votes of the whole subtree have been collected */
+    bool subtree_complete(const block_t &blk);
+    /** verify the optimistic votes as one aggregate and merge them */
+    bool verify_optimistic_votes(const block_t &blk);
+    /** find the invalid votes in [begin, end) by splitting the aggregate */
+    void blame_votes(const uint256_t &blk_hash, const std::vector<Vote> &votes,
+                     size_t begin, size_t end, std::vector<bool> &valid);
+
+    /** aggregation deadline of a block at an internal node */
+    struct AggDeadline {
+        TimerEvent timer;
+        struct timeval start;
+        uint32_t height;
+        /** the partial aggregate went up, later votes are sent as top-ups */
+        bool forwarded;
+    };
+    std::unordered_map<const uint256_t, AggDeadline> agg_deadlines;
+    /** smoothed delay of the child contributions and its deviation */
+    double agg_delay;
+    double agg_delay_var;
+
+    /** start waiting for the subtree once this node voted for blk */
+    void arm_agg_deadline(const block_t &blk);
+    void disarm_agg_deadline(const uint256_t &blk_hash);
+    /** sample the delay of a child contribution, returns true if the
+     * partial aggregate of blk was already relayed */
+    bool on_child_contribution(const block_t &blk);
+    void on_agg_deadline(uint256_t blk_hash);
+    /** drop the aggregation state of the blocks far below `height` */
+    void prune_agg_state(uint32_t height);
+
+    /** shape of the dissemination tree, balanced k-ary by default */
+    topology_builder_bt topology;
+    /** peer of every replica, by replica id */
+    std::vector<PeerId> replica_peers;
+    /** the tree in use, every epoch rotates the internal-node roles */
+    uint32_t tree_epoch;
+    /** epoch the current topology was installed at */
+    uint32_t tree_base_epoch;
+    /** the most recent block this replica voted for */
+    block_t last_voted;
+    TimerEvent reconfig_timer;
+    uint32_t reconfig_last_height;
+
+    /** this replica's place in the trees `builder` gives for `epoch`, with
+     * every subtree appended to `all_subtrees` if not null */
+    std::vector<TreeView> derive_trees(TopologyBuilder &builder, uint32_t epoch,
+                                    uint32_t base_epoch,
+                                    std::vector<salticidae::Bits> *all_subtrees = nullptr);
+    /** derive the tree of `epoch` and take this replica's place in it */
+    void build_tree(uint32_t epoch);
+    /** move to the tree of `epoch` and vote again for the blocks above `height` */
+    void switch_tree(uint32_t epoch, uint32_t height);
+    /** at the proposer, change the tree if no QC was formed for a while */
+    void on_reconfig_timer();
+
+    /** smallest round-trip time seen to every replica */
+    std::vector<uint32_t> peer_rtts;
+    /** all replicas' round-trip times, collected by the proposer */
+    std::vector<uint32_t> rtt_matrix;
+    /** the round-trip times the latency-aware tree was derived from */
+    std::vector<uint32_t> latency_rtts;
+    /** replicas whose round-trip times reached the proposer */
+    std::set<ReplicaID> rtt_reporters;
+    size_t latency_round;
+    TimerEvent latency_timer;
+
+    /** bootstrap step of the latency-aware tree: ping, report, build */
+    void on_latency_timer();
+    /** at the proposer, derive the latency-aware tree and switch to it */
+    void install_latency_tree();
+    /** the latency-aware builder for `rtts`, indexed by replica id */
+    topology_builder_bt latency_topology(const std::vector<uint32_t> &rtts);
 
     void on_fetch_cmd(const command_t &cmd);
     void on_fetch_blk(const block_t &blk);
+    /** resolved once the block is parsed and stored */
+    promise_t async_blk_arrival(const uint256_t &blk_hash);
+    void on_blk_arrival(const block_t &blk);
     bool on_deliver_blk(const block_t &blk);
+    /** parses and delivers a proposal after it has been relayed */
+    void on_relayed_proposal(PendingProposal &&p);
+    void deliver_proposal(MsgPropose &msg, const PeerId &peer, uint8_t tree);
+    /** turns the buffered commands into the next block and proposes it */
+    void cut_block();
+    /** picks the size of the next block from the backlog and QC latency */
+    void adapt_blk_size();
+    /** sends the collected client commands to the current proposer */
+    void flush_forwarded();
+
+    /** deserialize blocks and certificates on the verification workers */
+    bool async_parse;
+    /** runs `msg.pre_parse` on a worker, then `handler` on the event loop */
+    template<typename M>
+    void parse_async(M &&msg, const Net::conn_t &conn,
+                    void (HotStuffBase::*handler)(M &&, const Net::conn_t &));
 
     /** deliver consensus message: <propose> */
     inline void propose_handler(MsgPropose &&, const Net::conn_t &);
+    /** relays a piece of a proposal and reassembles the proposal */
+    inline void propose_chunk_handler(MsgProposeChunk &&, const Net::conn_t &);
+    /** relays and echoes coded fragments and decodes the proposal */
+    inline void fragments_handler(MsgFragments &&, const Net::conn_t &);
+    /** receives a batch of commands */
+    inline void batch_handler(MsgBatch &&, const Net::conn_t &);
+    /** the command of fetching a batch */
+    inline void req_batch_handler(MsgReqBatch &&, const Net::conn_t &);
+    /** takes the client commands forwarded by another replica */
+    inline void forward_cmds_handler(MsgForwardCmds &&, const Net::conn_t &);
+    /** unpacks a bundle and hands every message to its handler */
+    inline void bundle_handler(MsgBundle &&, const Net::conn_t &);
     /** deliver consensus message: <vote> */
     inline void vote_handler(MsgVote &&, const Net::conn_t &);
     /** deliver consensus relay message: <vote_relay> */
     inline void vote_relay_handler(MsgRelay &&, const Net::conn_t &);
+    /** handle a vote or relay whose block is stored */
+    void on_vote(Vote &&vote, const PeerId &peer);
+    void on_vote_relay(VoteRelay &&vote, const PeerId &peer);
+    /** finishes the pipelined blocks that were certified while waiting for
+     * `blk` */
+    void finish_certified_successors(const block_t &blk);
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
     /** receives a block */
     inline void resp_blk_handler(MsgRespBlock &&, const Net::conn_t &);
+    /** switches to another dissemination tree */
+    inline void reconfig_handler(MsgReconfig &&, const Net::conn_t &);
+    /** measures the round-trip time to other replicas */
+    inline void ping_handler(MsgPing &&, const Net::conn_t &);
+    inline void pong_handler(MsgPong &&, const Net::conn_t &);
+    /** collects the round-trip times at the root */
+    inline void rtt_report_handler(MsgRttReport &&, const Net::conn_t &);
 
     inline bool conn_handler(const salticidae::ConnPool::conn_t &, bool);
 
@@ -234,8 +726,9 @@ class HotStuffBase: public HotStuffCore {
 
     /* the API for HotStuffBase */
 
-    /* Submit the command to be decided. */
-    void exec_command(uint256_t cmd_hash, commit_cb_t callback);
+    /* Submit the command to be decided. `cmd_size` counts towards the byte
+     * budget of a block (the size of the hash if 0). */
+    void exec_command(uint256_t cmd_hash, commit_cb_t callback, size_t cmd_size = 0);
     void start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
                 bool ec_loop = false);
     void beat();
@@ -244,7 +737,54 @@ class HotStuffBase: public HotStuffCore {
     const auto &get_decision_waiting() const { return decision_waiting; }
     ThreadCall &get_tcall() { return tcall; }
     PaceMaker *get_pace_maker() { return pmaker.get(); }
+    /** Returns a promise resolved when the tree neighbours are connected. */
+    promise_t get_ready() const { return ready; }
     void print_stat() const;
+    /** Set the shape of the dissemination tree (before start). */
+    void set_topology(TopologyBuilder *builder) { topology = topology_builder_bt(builder); }
+    /** Coalesce signature checks on the same block within `window` seconds. */
+    void set_vote_batch_window(double window) { vpool.set_batch_window(window); }
+    /** Send proposals larger than `size` bytes in chunks that are relayed as
+     * they arrive (0 to disable), for proposals of at most `max_msg_size`
+     * bytes. */
+    void set_chunk_size(size_t size, size_t max_msg_size) {
+        chunk_size = size;
+        max_nchunks = size ? (max_msg_size + size - 1) / size : 0;
+    }
+    /** Erasure-code proposals so that every subtree gets different fragments
+     * and the replicas rebuild the block from each other's (before start). */
+    void set_erasure_coding(bool enabled) { erasure_coding = enabled; }
+    /** Disseminate commands in batches of `size` among all replicas and
+     * propose only their digests (0 to disable). */
+    void set_batch_size(size_t size) { batch_size = size; }
+    /** Coalesce the votes and relays to the same replica sent within
+     * `window` seconds, 0 for one event-loop iteration (negative to
+     * disable). */
+    void set_coalesce_window(double window) { coalesce_window = window; }
+    /** Send votes and relays over a second connection to every replica,
+     * listening on the replica port plus `offset` (0 to disable, before
+     * start). */
+    void set_ctl_port_offset(uint16_t offset) { ctl_port_offset = offset; }
+    /** Keep connections to the tree neighbours only and open the others
+     * when needed, closing them when idle (before start). */
+    void set_sparse_mesh(bool enabled) { sparse_mesh = enabled; }
+    /** Deserialize proposals, relays and fetched blocks on the worker
+     * threads instead of the event loop. */
+    void set_async_parse(bool enabled) { async_parse = enabled; }
+    /** Also cut a block once the buffered commands reach `bytes` (0 to
+     * disable). */
+    void set_blk_bytes(size_t bytes) { blk_bytes = bytes; }
+    /** Also cut a block once its oldest command waited `deadline` seconds
+     * (0 to disable). */
+    void set_blk_deadline(double deadline) { blk_deadline = deadline; }
+    /** Tune the block size between `min` and `max` commands with the load
+     * (0 as the maximum to keep it fixed, before start). */
+    void set_blk_size_bounds(size_t min, size_t max) {
+        if (max && min > max)
+            throw std::invalid_argument("the minimal block size exceeds the maximal one");
+        blk_size_min = std::max(min, (size_t)1);
+        blk_size_max = max;
+    }
     virtual void do_elected() {}
 //#ifdef HOTSTUFF_AUTOCLI
 //    virtual void do_demand_commands(size_t) {}
@@ -330,6 +870,78 @@ class HotStuff: public HotStuffBase {
     void set_piped_latency(int32_t piped_latency, int32_t async_blocks) {
         HotStuffBase::set_piped_latency(piped_latency, async_blocks);
     }
+
+    void set_adaptive_pipeline(bool adaptive_pipeline) {
+        HotStuffBase::set_adaptive_pipeline(adaptive_pipeline);
+    }
+
+    void set_optimistic_verify(bool optimistic_verify) {
+        HotStuffBase::set_optimistic_verify(optimistic_verify);
+    }
+
+    void set_agg_timeout(double agg_timeout) {
+        HotStuffBase::set_agg_timeout(agg_timeout);
+    }
+
+    void set_reconfig_timeout(double reconfig_timeout) {
+        HotStuffBase::set_reconfig_timeout(reconfig_timeout);
+    }
+
+    void set_topology(TopologyBuilder *builder) {
+        HotStuffBase::set_topology(builder);
+    }
+
+    void set_latency_tree(bool latency_tree) {
+        HotStuffBase::set_latency_tree(latency_tree);
+    }
+
+    void set_ntrees(int32_t ntrees) {
+        HotStuffBase::set_ntrees(ntrees);
+    }
+
+    void set_vote_batch_window(double window) {
+        HotStuffBase::set_vote_batch_window(window);
+    }
+
+    void set_chunk_size(size_t size, size_t max_msg_size) {
+        HotStuffBase::set_chunk_size(size, max_msg_size);
+    }
+
+    void set_erasure_coding(bool enabled) {
+        HotStuffBase::set_erasure_coding(enabled);
+    }
+
+    void set_batch_size(size_t size) {
+        HotStuffBase::set_batch_size(size);
+    }
+
+    void set_coalesce_window(double window) {
+        HotStuffBase::set_coalesce_window(window);
+    }
+
+    void set_ctl_port_offset(uint16_t offset) {
+        HotStuffBase::set_ctl_port_offset(offset);
+    }
+
+    void set_sparse_mesh(bool enabled) {
+        HotStuffBase::set_sparse_mesh(enabled);
+    }
+
+    void set_async_parse(bool enabled) {
+        HotStuffBase::set_async_parse(enabled);
+    }
+
+    void set_blk_bytes(size_t bytes) {
+        HotStuffBase::set_blk_bytes(bytes);
+    }
+
+    void set_blk_deadline(double deadline) {
+        HotStuffBase::set_blk_deadline(deadline);
+    }
+
+    void set_blk_size_bounds(size_t min, size_t max) {
+        HotStuffBase::set_blk_size_bounds(min, max);
+    }
 };
 
 using HotStuffNoSig = HotStuff<>;
@@ -382,7 +994,7 @@ FetchContext<ent_type>::FetchContext(
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const PeerId &replica) {
     hs->part_fetched_replica[replica]++;
-    hs->pn.send_msg(fetch_msg, replica);
+    hs->send_lazy(fetch_msg, replica);
 }
 
 template<EntityType ent_type>
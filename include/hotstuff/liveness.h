@@ -147,7 +147,7 @@ class PMWaitQC: public virtual PaceMaker {
                 struct timeval current_time;
                 gettimeofday(&current_time, NULL);
 
-                if (hsc->piped_queue.size() < hsc->get_config().async_blocks
+                if (hsc->piped_window.size() < hsc->get_config().async_blocks
                 && !hsc->piped_submitted
                 && ((current_time.tv_sec - hsc->last_block_time.tv_sec) * 1000000 + current_time.tv_usec - hsc->last_block_time.tv_usec) / 1000 > hsc->get_config().piped_latency) {
                     HOTSTUFF_LOG_PROTO("Extra block");
@@ -158,8 +158,8 @@ class PMWaitQC: public virtual PaceMaker {
                     return;
                 }
 
-                if (!hsc->piped_queue.empty() && hsc->b_normal_height > 0) {
-                    block_t piped_block = hsc->storage->find_blk(hsc->piped_queue.back());
+                if (!hsc->piped_window.empty() && hsc->b_normal_height > 0) {
+                    const block_t &piped_block = hsc->piped_window.back();
                     if ( piped_block->get_height() > hsc->get_config().async_blocks + 10 && hsc->b_normal_height < piped_block->get_height() - (hsc->get_config().async_blocks + 10)
                             && ((current_time.tv_sec - hsc->last_block_time.tv_sec) * 1000000 + current_time.tv_usec - hsc->last_block_time.tv_usec) / 1000 > hsc->get_config().piped_latency) {
                         HOTSTUFF_LOG_PROTO("Extra recovery block %d %d", hsc->b_normal_height, piped_block->get_height());
@@ -17,21 +17,58 @@
 #ifndef _HOTSTUFF_WORKER_H
 #define _HOTSTUFF_WORKER_H
 
+#include <algorithm>
+#include <chrono>
 #include <thread>
 #include <unordered_map>
 #include <unistd.h>
 
 #include "salticidae/event.h"
+#include "hotstuff/type.h"
 #include "hotstuff/util.h"
 
 namespace hotstuff {
 
 class VeriTask {
     friend class VeriPool;
+    friend class VeriBatch;
     bool result;
     public:
     virtual bool verify() = 0;
     virtual ~VeriTask() = default;
+    /** The outcome of the check, once VeriPool has run it. */
+    bool get_result() const { return result; }
+};
+
+/** A task that can be checked together with other tasks on the same message. */
+class BatchVeriTask: public VeriTask {
+    public:
+    virtual const uint256_t &get_msg() const = 0;
+    /** Check all tasks of the batch at once (including this one). */
+    virtual bool verify_batch(const std::vector<BatchVeriTask *> &batch) = 0;
+};
+
+/** Tasks on the same message coalesced by VeriPool. */
+class VeriBatch: public VeriTask {
+    friend class VeriPool;
+    std::vector<BatchVeriTask *> tasks;
+
+    public:
+    void add(BatchVeriTask *task) { tasks.push_back(task); }
+    size_t size() const { return tasks.size(); }
+
+    bool verify() override {
+        if (tasks.size() > 1 && tasks[0]->verify_batch(tasks))
+        {
+            for (auto t: tasks) t->result = true;
+            return true;
+        }
+        /* fall back to individual checks to tell who is wrong */
+        bool ok = true;
+        for (auto t: tasks)
+            ok &= (t->result = t->verify());
+        return ok;
+    }
 };
 
 using salticidae::ThreadCall;
@@ -52,20 +89,70 @@ class VeriPool {
     std::vector<Worker> workers;
     std::unordered_map<VeriTask *, std::pair<veritask_ut, promise_t>> pms;
 
+    /** how long (in seconds) batchable tasks wait for company, 0 to disable */
+    double batch_window;
+    size_t max_batch;
+    using clock = std::chrono::steady_clock;
+    struct PendingBatch {
+        VeriBatch *batch;
+        /** every batch waits `batch_window` from its first task */
+        clock::time_point deadline;
+    };
+    /** batchable tasks waiting for the window to close, by message */
+    std::unordered_map<uint256_t, PendingBatch> pending_batches;
+    /** armed for the earliest deadline of the pending batches */
+    TimerEvent batch_timer;
+
+    void resolve(VeriTask *task) {
+        auto it = pms.find(task);
+        it->second.second.resolve(task->result);
+        pms.erase(it);
+    }
+
+    /** hands the batches whose window closed (or all of them) to the
+     * workers */
+    void flush_batches(bool all = true) {
+        batch_timer.del();
+        auto now = clock::now();
+        auto next = clock::time_point::max();
+        for (auto it = pending_batches.begin(); it != pending_batches.end();)
+        {
+            if (all || it->second.deadline <= now)
+            {
+                in_queue.enqueue(it->second.batch);
+                it = pending_batches.erase(it);
+            }
+            else
+            {
+                next = std::min(next, it->second.deadline);
+                it++;
+            }
+        }
+        if (!pending_batches.empty())
+            batch_timer.add(std::chrono::duration<double>(next - now).count());
+    }
+
     public:
-    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128) {
+    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128):
+            batch_window(0), max_batch(burst_size) {
         out_queue.reg_handler(ec, [this, burst_size](mpsc_queue_t &q) {
             size_t cnt = burst_size;
             VeriTask *task;
             while (q.try_dequeue(task))
             {
-                auto it = pms.find(task);
-                it->second.second.resolve(task->result);
-                pms.erase(it);
+                auto batch = dynamic_cast<VeriBatch *>(task);
+                if (batch)
+                {
+                    for (auto t: batch->tasks) resolve(t);
+                    delete batch;
+                }
+                else
+                    resolve(task);
                 if (!--cnt) return true;
             }
             return false;
         });
+        batch_timer = TimerEvent(ec, [this](TimerEvent &) { flush_batches(false); });
 
         workers.resize(nworker);
         for (size_t i = 0; i < nworker; i++)
@@ -92,6 +179,9 @@ class VeriPool {
     }
 
     ~VeriPool() {
+        batch_timer.del();
+        for (auto &p: pending_batches)
+            delete p.second.batch;
         for (auto &w: workers)
             w.tcall->async_call([ec=w.ec](ThreadCall::Handle &) {
                 ec.stop();
@@ -105,9 +195,40 @@ class VeriPool {
         auto ret = pms.insert(std::make_pair(ptr,
                 std::make_pair(std::move(task), promise_t([](promise_t &){}))));
         assert(ret.second);
-        in_queue.enqueue(ptr);
+        auto btask = batch_window > 0 ? dynamic_cast<BatchVeriTask *>(ptr) : nullptr;
+        if (btask == nullptr)
+            in_queue.enqueue(ptr);
+        else
+        {
+            auto it = pending_batches.find(btask->get_msg());
+            if (it == pending_batches.end())
+            {
+                auto deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+                                    std::chrono::duration<double>(batch_window));
+                it = pending_batches.insert(std::make_pair(btask->get_msg(),
+                        PendingBatch{new VeriBatch(), deadline})).first;
+                /* later batches have later deadlines, the timer keeps the earliest */
+                if (pending_batches.size() == 1)
+                    batch_timer.add(batch_window);
+            }
+            auto batch = it->second.batch;
+            batch->add(btask);
+            if (batch->size() >= max_batch)
+            {
+                in_queue.enqueue(batch);
+                pending_batches.erase(it);
+                if (pending_batches.empty()) batch_timer.del();
+            }
+        }
         return ret.first->second.second;
     }
+
+    /** Coalesce batchable tasks on the same message arriving within `window`
+     * seconds into one check. */
+    void set_batch_window(double window) {
+        if (window <= 0) flush_batches();
+        batch_window = window;
+    }
 };
 
 }
@@ -0,0 +1,108 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_TOPOLOGY_H
+#define _HOTSTUFF_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** A dissemination tree rooted at replica 0. */
+struct Tree {
+    /** parent of every replica, -1 for the root */
+    std::vector<int> parent;
+    /** children of every replica */
+    std::vector<std::vector<ReplicaID>> children;
+
+    Tree(std::vector<int> &&parent);
+
+    size_t size() const { return parent.size(); }
+};
+
+/** Abstraction for the shape of the dissemination tree. */
+class TopologyBuilder {
+    public:
+    virtual ~TopologyBuilder() = default;
+    /** Returns the tree connecting `nreplicas` replicas. */
+    virtual Tree build(size_t nreplicas) = 0;
+};
+
+using topology_builder_bt = BoxObj<TopologyBuilder>;
+
+/** Every replica is a child of the root (vanilla HotStuff). */
+class TopologyStar: public TopologyBuilder {
+    public:
+    Tree build(size_t nreplicas) override;
+};
+
+/** Balanced tree filled level by level, with at most `fanout` children per
+ * node. */
+class TopologyKAry: public TopologyBuilder {
+    size_t fanout;
+
+    public:
+    TopologyKAry(size_t fanout): fanout(fanout) {}
+    Tree build(size_t nreplicas) override;
+};
+
+/** Tree with at most `max_degree` children per node, where the replicas with
+ * the most bandwidth get the internal positions. */
+class TopologyDegreeBounded: public TopologyBuilder {
+    size_t max_degree;
+    std::vector<double> bandwidth;
+
+    public:
+    TopologyDegreeBounded(size_t max_degree, std::vector<double> bandwidth):
+        max_degree(max_degree), bandwidth(std::move(bandwidth)) {}
+    Tree build(size_t nreplicas) override;
+
+    /** Reads the bandwidth of every replica, one number per line. */
+    static std::vector<double> read_bandwidth(const std::string &fname);
+};
+
+/** Tree with at most `fanout` children per node that keeps the path from the
+ * root to the deepest replica (and back, for aggregation) short, given the
+ * measured round-trip times between all replicas. */
+class TopologyLatency: public TopologyBuilder {
+    size_t fanout;
+    /** round-trip time (in microseconds) from replica i to replica j at
+     * i * n + j, UINT32_MAX if unknown */
+    std::vector<uint32_t> rtts;
+
+    public:
+    TopologyLatency(size_t fanout, std::vector<uint32_t> rtts):
+        fanout(fanout), rtts(std::move(rtts)) {}
+    Tree build(size_t nreplicas) override;
+};
+
+/** Tree read from a file, with one "<replica> <parent>" line per non-root
+ * replica. */
+class TopologyFile: public TopologyBuilder {
+    std::string fname;
+
+    public:
+    TopologyFile(const std::string &fname): fname(fname) {}
+    Tree build(size_t nreplicas) override;
+};
+
+}
+
+#endif
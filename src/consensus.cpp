@@ -15,7 +15,9 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stack>
 
 #include "hotstuff/util.h"
@@ -75,8 +77,8 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
     }
     blk->parents.clear();
     for (const auto &hash: blk->parent_hashes) {
-        if (!piped_queue.empty() && std::find(piped_queue.begin(), piped_queue.end(), hash) != piped_queue.end()) {
-            block_t piped_block = storage->find_blk(hash);
+        block_t piped_block = piped_window.find(hash);
+        if (piped_block != nullptr) {
             blk->parents.push_back(piped_block);
         }
         else {
@@ -200,7 +202,7 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
     /* create the new block */
 
     block_t bnew;
-    if (piped_queue.empty()) {
+    if (piped_window.empty()) {
         LOG_PROTO("b_piped is null");
         bnew = storage->add_blk(
                 new Block(parents, cmds,
@@ -211,7 +213,7 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
                 ));
     } else {
         auto newParents = std::vector<block_t>(parents);
-        block_t piped_block = storage->find_blk(piped_queue.back());
+        const block_t &piped_block = piped_window.back();
 
         if (newParents[0]->height <= piped_block->height) {
             LOG_PROTO("b_piped is not null");
@@ -228,6 +230,7 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
     }
 
     b_normal_height = bnew->get_height();
+    pipe_ctl.on_propose(bnew->get_hash());
 
     LOG_PROTO("propose %s", std::string(*bnew).c_str());
     Proposal prop = process_block(bnew, true);
@@ -362,6 +365,15 @@ void HotStuffCore::on_init(uint32_t nfaulty) {
     b0->self_qc = b0->qc->clone();
     b0->qc_ref = b0;
     hqc = std::make_pair(b0, b0->qc->clone());
+    /* without pipelining there is nothing to tune */
+    if (config.async_blocks <= 0)
+        config.adaptive_pipeline = false;
+    if (config.adaptive_pipeline)
+    {
+        pipe_ctl.init(config.async_blocks, config.piped_latency);
+        config.async_blocks = pipe_ctl.get_depth();
+        config.piped_latency = pipe_ctl.get_delay();
+    }
 }
 
 void HotStuffCore::prune(uint32_t staleness) {
@@ -377,6 +389,7 @@ void HotStuffCore::prune(uint32_t staleness) {
         auto &blk = s.top();
         if (blk->parents.empty())
         {
+            bls_msg_hash_cache.erase(blk->get_hash());
             storage->try_release_blk(blk);
             s.pop();
             continue;
@@ -414,6 +427,12 @@ promise_t HotStuffCore::async_qc_finish(const block_t &blk) {
 }
 
 void HotStuffCore::on_qc_finish(const block_t &blk) {
+    /* the QC latency is also used to size the blocks */
+    if (pipe_ctl.on_qc(blk->get_hash()) && config.adaptive_pipeline)
+    {
+        config.async_blocks = pipe_ctl.get_depth();
+        config.piped_latency = pipe_ctl.get_delay();
+    }
     auto it = qc_waiting.find(blk);
     if (it != qc_waiting.end())
     {
@@ -481,4 +500,132 @@ void HotStuffCore::set_piped_latency(int32_t piped_latency, int32_t async_blocks
     config.async_blocks = async_blocks;
 }
 
+void HotStuffCore::set_adaptive_pipeline(bool adaptive_pipeline) {
+    config.adaptive_pipeline = adaptive_pipeline;
+}
+
+void HotStuffCore::set_optimistic_verify(bool optimistic_verify) {
+    config.optimistic_verify = optimistic_verify;
+}
+
+void HotStuffCore::set_agg_timeout(double agg_timeout) {
+    config.agg_timeout = agg_timeout;
+}
+
+void HotStuffCore::set_reconfig_timeout(double reconfig_timeout) {
+    config.reconfig_timeout = reconfig_timeout;
+}
+
+void HotStuffCore::set_latency_tree(bool latency_tree) {
+    config.latency_tree = latency_tree;
+}
+
+void HotStuffCore::set_ntrees(int32_t ntrees) {
+    config.ntrees = ntrees;
+}
+
+block_t PipelineWindow::find(const uint256_t &hash) const {
+    auto it = entries.find(hash);
+    return it == entries.end() ? nullptr : it->second.blk;
+}
+
+void PipelineWindow::push_back(const block_t &blk) {
+    const auto &hash = blk->get_hash();
+    if (entries.count(hash)) return;
+    order.push_back(hash);
+    entries.emplace(hash, Entry{blk, std::prev(order.end()), false});
+    children[blk->get_parent_hashes()[0]].push_back(hash);
+}
+
+void PipelineWindow::unlink(const block_t &blk) {
+    auto it = children.find(blk->get_parent_hashes()[0]);
+    if (it == children.end()) return;
+    auto &siblings = it->second;
+    siblings.erase(std::find(siblings.begin(), siblings.end(), blk->get_hash()));
+    if (siblings.empty()) children.erase(it);
+}
+
+bool PipelineWindow::erase(const uint256_t &hash) {
+    auto it = entries.find(hash);
+    if (it == entries.end()) return false;
+    unlink(it->second.blk);
+    order.erase(it->second.pos);
+    entries.erase(it);
+    return true;
+}
+
+void PipelineWindow::set_certified(const uint256_t &hash) {
+    auto it = entries.find(hash);
+    if (it != entries.end()) it->second.certified = true;
+}
+
+std::vector<block_t> PipelineWindow::drain_certified(const block_t &blk) {
+    std::vector<block_t> chain;
+    uint256_t curr = blk->get_hash();
+    for (;;)
+    {
+        auto it = children.find(curr);
+        if (it == children.end()) break;
+        block_t next;
+        for (const auto &hash: it->second)
+        {
+            const auto &e = entries.at(hash);
+            if (e.certified) { next = e.blk; break; }
+        }
+        if (next == nullptr) break;
+        curr = next->get_hash();
+        erase(curr);
+        chain.push_back(std::move(next));
+    }
+    return chain;
+}
+
+static double now_ms() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1e3 + t.tv_usec / 1e3;
+}
+
+void PipelineController::init(int32_t _max_depth, int32_t _min_delay) {
+    max_depth = std::max(_max_depth, 1);
+    min_delay = std::max(_min_delay, 0);
+    depth = max_depth;
+    delay = min_delay;
+}
+
+void PipelineController::on_propose(const uint256_t &blk_hash) {
+    double now = now_ms();
+    if (last_sent > 0)
+        gap = gap > 0 ? gap + alpha * (now - last_sent - gap) : now - last_sent;
+    last_sent = now;
+    /* forget the blocks that will never get a QC, e.g. after a view change */
+    if (sent.size() >= max_tracked) sent.clear();
+    sent[blk_hash] = now;
+}
+
+bool PipelineController::on_qc(const uint256_t &blk_hash) {
+    auto it = sent.find(blk_hash);
+    if (it == sent.end()) return false;
+    double lat = now_ms() - it->second;
+    sent.erase(it);
+    qc_latency = qc_latency > 0 ? qc_latency + alpha * (lat - qc_latency) : lat;
+
+    if (part_stalls)
+    {
+        backoff = std::min(backoff * 1.5, max_backoff);
+        part_stalls = 0;
+    }
+    else
+        backoff = std::max(backoff * 0.95, 1.0);
+
+    /* spread at most max_depth blocks over one QC latency */
+    double d = std::max((double)min_delay, qc_latency / max_depth) * backoff;
+    /* proposals cannot be closer than they actually arrive */
+    double spacing = std::max(std::max(d, gap), 1.0);
+    int32_t n = (int32_t)std::ceil(qc_latency / spacing) + 1;
+    depth = std::min(std::max(n, 1), max_depth);
+    delay = (int32_t)std::lround(d);
+    return true;
+}
+
 }
@@ -68,12 +68,174 @@ namespace hotstuff {
         });
     }
 
+    MsgHashCacheBLS bls_msg_hash_cache;
+
+    bls::G2Element MsgHashCacheBLS::get(const uint256_t &msg) {
+        {
+            std::lock_guard<std::mutex> _(cache_lock);
+            auto it = cache.find(msg);
+            if (it != cache.end()) return it->second.first;
+        }
+        /* map outside the lock, a racing thread at worst maps it twice */
+        bls::G2Element hashed = bls::G2Element::FromMessage(arrToVec(msg.to_bytes()),
+                bls::PopSchemeMPL::CIPHERSUITE_ID, bls::PopSchemeMPL::CIPHERSUITE_ID_LEN);
+        std::lock_guard<std::mutex> _(cache_lock);
+        if (!cache.count(msg))
+        {
+            cache.insert(std::make_pair(msg, std::make_pair(hashed, order.insert(order.end(), msg))));
+            while (order.size() > max_entries)
+            {
+                cache.erase(order.front());
+                order.pop_front();
+            }
+        }
+        return hashed;
+    }
+
+    void MsgHashCacheBLS::erase(const uint256_t &msg) {
+        std::lock_guard<std::mutex> _(cache_lock);
+        auto it = cache.find(msg);
+        if (it == cache.end()) return;
+        order.erase(it->second.second);
+        cache.erase(it);
+    }
+
+    bool verify_bls(const bls::G1Element &pub, const uint256_t &msg, const bls::G2Element &sig) {
+        /* same as CoreMPL::Verify, minus the hash-to-curve:
+         * e(-g1, sig) * e(pub, H(m)) == 1 */
+        bls::G2Element hashed = bls_msg_hash_cache.get(msg);
+        g1_t g1s[2];
+        g2_t g2s[2];
+        bls::G1Element::Generator().Negate().ToNative(g1s);
+        pub.ToNative(g1s + 1);
+        sig.ToNative(g2s);
+        hashed.ToNative(g2s + 1);
+
+        gt_t target, candidate;
+        fp12_zero(target);
+        fp_set_dig(target[0][0][0], 1);
+        pc_map_sim(candidate, g1s, g2s, 2);
+        if (gt_cmp(target, candidate) != RLC_EQ || core_get()->code != RLC_OK)
+        {
+            core_get()->code = RLC_OK;
+            return false;
+        }
+        bls::BLS::CheckRelicErrors();
+        return true;
+    }
+
     QuorumCertAggBLS::QuorumCertAggBLS(
             const ReplicaConfig &config, const uint256_t &obj_hash) :
             QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas){
         rids.clear();
     }
 
+    std::string PubKeyAggCacheBLS::get_key(const salticidae::Bits &rids) {
+        std::string key((rids.size() + 7) >> 3, '\0');
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) key[i >> 3] |= (char)(1 << (i & 7));
+        return key;
+    }
+
+    const bls::G1Element &PubKeyAggCacheBLS::get_pub(const ReplicaConfig &config, ReplicaID rid) {
+        return *static_cast<const PubKeyBLS &>(config.get_pubkey(rid)).data;
+    }
+
+    void PubKeyAggCacheBLS::seed(const ReplicaConfig &config, const salticidae::Bits &rids) {
+        vector<bls::G1Element> pubs;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) {
+                /* only BLS keys can be aggregated */
+                if (dynamic_cast<const PubKeyBLS *>(&config.get_pubkey(i)) == nullptr) return;
+                pubs.push_back(get_pub(config, i));
+            }
+        if (pubs.empty()) return;
+        bls::G1Element agg = bls::PopSchemeMPL::Aggregate(pubs);
+        seeds.push_back(std::make_pair(rids, agg));
+        cache.insert(std::make_pair(get_key(rids), agg));
+    }
+
+    bls::G1Element PubKeyAggCacheBLS::get(const ReplicaConfig &config, const salticidae::Bits &rids) {
+        auto key = get_key(rids);
+        auto it = cache.find(key);
+        if (it != cache.end()) return it->second;
+
+        size_t nsigned = 0;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) nsigned++;
+
+        /* find the seed covering all signers with the fewest extra keys */
+        const std::pair<salticidae::Bits, bls::G1Element> *best = nullptr;
+        size_t best_extra = nsigned;
+        for (const auto &s: seeds)
+        {
+            if (s.first.size() != rids.size()) continue;
+            size_t extra = 0;
+            bool covers = true;
+            for (size_t i = 0; i < rids.size() && covers && extra < best_extra; i++)
+            {
+                if (rids.get(i))
+                    covers = s.first.get(i);
+                else if (s.first.get(i))
+                    extra++;
+            }
+            if (covers && extra < best_extra)
+            {
+                best = &s;
+                best_extra = extra;
+            }
+        }
+
+        vector<bls::G1Element> pubs;
+        for (size_t i = 0; i < rids.size(); i++)
+        {
+            bool take = best ? (best->first.get(i) && !rids.get(i)) : rids.get(i);
+            if (take) pubs.push_back(get_pub(config, i));
+        }
+
+        bls::G1Element agg = best == nullptr ?
+            bls::PopSchemeMPL::Aggregate(pubs) :
+            (pubs.empty() ? best->second :
+                best->second + bls::PopSchemeMPL::Aggregate(pubs).Negate());
+
+        if (cache.size() >= max_entries)
+        {
+            cache.clear();
+            for (const auto &s: seeds)
+                cache.insert(std::make_pair(get_key(s.first), s.second));
+        }
+        cache.insert(std::make_pair(std::move(key), agg));
+        return agg;
+    }
+
+    bool SigVeriTaskBLSBatch::verify_batch(const std::vector<BatchVeriTask *> &batch) {
+        /* with one message, e(g1, sum r_i * sig_i) == e(sum r_i * pub_i, H(m))
+         * checks the whole batch, and random r_i keep invalid signatures from
+         * cancelling each other out */
+        vector<bls::G1Element> pubs;
+        vector<bls::G2Element> sigs;
+        uint8_t scalar[16];
+        bn_t r;
+        bn_new(r);
+        for (auto t: batch)
+        {
+            auto task = dynamic_cast<SigVeriTaskBLSBatch *>(t);
+            if (task == nullptr || !(task->msg == msg) ||
+                RAND_bytes(scalar, sizeof(scalar)) != 1)
+            {
+                bn_free(r);
+                return false;
+            }
+            scalar[0] |= 0x80;
+            bn_read_bin(r, scalar, sizeof(scalar));
+            pubs.push_back(task->get_pub() * r);
+            sigs.push_back(task->get_sig() * r);
+        }
+        bn_free(r);
+        return verify_bls(bls::PopSchemeMPL::Aggregate(pubs), msg,
+                          bls::PopSchemeMPL::Aggregate(sigs));
+    }
+
     bool QuorumCertAggBLS::verify(const ReplicaConfig &config) {
         if (theSig == nullptr) return false;
         //HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",i, get_hex10(obj_hash).c_str());
@@ -81,12 +243,7 @@ namespace hotstuff {
         struct timeval timeStart,timeEnd;
         gettimeofday(&timeStart, nullptr);
 
-        vector<bls::G1Element> pubs;
-        for (unsigned int i = 0; i < rids.size(); i++) {
-            if (rids[i] == 1) {
-                pubs.push_back(*static_cast<const PubKeyBLS &>(config.get_pubkey(i)).data);
-            }
-        }
+        bls::G1Element pub = config.pubkey_agg_cache.get(config, rids);
 
         gettimeofday(&timeEnd, nullptr);
 
@@ -97,7 +254,7 @@ namespace hotstuff {
 
         gettimeofday(&timeStart, nullptr);
 
-        bool res = bls::PopSchemeMPL::FastAggregateVerify(pubs, arrToVec(obj_hash.to_bytes()), *theSig->data);
+        bool res = verify_bls(pub, obj_hash, *theSig->data);
 
         gettimeofday(&timeEnd, nullptr);
 
@@ -114,37 +271,16 @@ namespace hotstuff {
             return promise_t([](promise_t &pm) { pm.resolve(false); });
         std::vector<promise_t> vpm;
 
-        struct timeval timeStart,timeEnd;
-        gettimeofday(&timeStart, nullptr);
-
-        vector<bls::G1Element> pubs;
-        for (unsigned int i = 0; i < rids.size(); i++) {
-            if (rids[i] == 1) {
-                pubs.push_back(*static_cast<const PubKeyBLS &>(config.get_pubkey(i)).data);
-            }
-        }
-
-
         //HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s", i, get_hex10(obj_hash).c_str());
 
-        vpm.push_back(vpool.verify(new SigVeriTaskBLSAgg(obj_hash, pubs, *theSig)));
+        vpm.push_back(vpool.verify(new SigVeriTaskBLSAgg(obj_hash,
+                                                         config.pubkey_agg_cache.get(config, rids),
+                                                         *theSig)));
 
         return promise::all(vpm).then([](const promise::values_t &values) {
             for (const auto &v: values)
                 if (!promise::any_cast<bool>(v)) return false;
             return true;
         });
-
-
-        /*const bool valid =  bls::PopSchemeMPL::FastAggregateVerify(pubs, arrToVec(obj_hash.to_bytes()), *theSig->data);
-
-        gettimeofday(&timeEnd, nullptr);
-
-        std::cout << "Fast Agg Verify: "
-                  << ((timeEnd.tv_sec - timeStart.tv_sec) * 1000000 + timeEnd.tv_usec - timeStart.tv_usec)
-                  << " us to execute."
-                  << std::endl;
-
-        return promise_t([&valid](promise_t &pm) { pm.resolve(valid); });*/
     }
 }
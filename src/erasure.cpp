@@ -0,0 +1,212 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "salticidae/crypto.h"
+#include "hotstuff/erasure.h"
+
+namespace hotstuff {
+
+namespace {
+
+/** arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+struct GF256 {
+    uint8_t exp[510];
+    uint8_t log[256];
+
+    GF256() {
+        unsigned x = 1;
+        for (size_t i = 0; i < 255; i++)
+        {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        log[0] = 0;
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        return a && b ? exp[log[a] + log[b]] : 0;
+    }
+
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+
+    /** dst ^= c * src */
+    void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) const {
+        if (!c) return;
+        const size_t lc = log[c];
+        for (size_t i = 0; i < len; i++)
+            if (src[i]) dst[i] ^= exp[lc + log[src[i]]];
+    }
+};
+
+const GF256 gf;
+
+uint256_t hash_pair(const uint256_t &a, const uint256_t &b) {
+    salticidae::SHA256 d;
+    d.update(a.to_bytes());
+    d.update(b.to_bytes());
+    return uint256_t(d.digest());
+}
+
+uint256_t hash_leaf(const bytearray_t &leaf) {
+    salticidae::SHA256 d;
+    d.update(leaf);
+    return uint256_t(d.digest());
+}
+
+}
+
+ReedSolomon::ReedSolomon(size_t k, size_t n): k(k), n(n), matrix(n * k, 0) {
+    if (k == 0 || k > n)
+        throw std::invalid_argument("invalid number of data fragments");
+    if (n > 256)
+        throw std::invalid_argument("at most 256 fragments are supported");
+    for (size_t i = 0; i < k; i++)
+        matrix[i * k + i] = 1;
+    /* every square submatrix of a Cauchy matrix is invertible, so are any k
+     * rows of the whole matrix */
+    for (size_t i = k; i < n; i++)
+        for (size_t j = 0; j < k; j++)
+            matrix[i * k + j] = gf.inv(i ^ j);
+}
+
+std::vector<bytearray_t> ReedSolomon::encode(const uint8_t *data, size_t size) const {
+    const size_t len = std::max((size + k - 1) / k, (size_t)1);
+    std::vector<bytearray_t> frags(n, bytearray_t(len, 0));
+    for (size_t j = 0; j < k; j++)
+    {
+        size_t begin = std::min(j * len, size);
+        size_t end = std::min(begin + len, size);
+        std::copy(data + begin, data + end, frags[j].begin());
+    }
+    for (size_t i = k; i < n; i++)
+        for (size_t j = 0; j < k; j++)
+            gf.mul_add(frags[i].data(), frags[j].data(), matrix[i * k + j], len);
+    return frags;
+}
+
+bytearray_t ReedSolomon::decode(const std::map<uint32_t, bytearray_t> &frags, size_t size) const {
+    if (frags.size() < k)
+        throw std::invalid_argument("not enough fragments to decode");
+    /* take the first k fragments and invert their rows of the matrix */
+    std::vector<uint32_t> rows;
+    std::vector<const bytearray_t *> srcs;
+    for (const auto &f: frags)
+    {
+        if (rows.size() == k) break;
+        if (f.first >= n)
+            throw std::invalid_argument("fragment index out of range");
+        rows.push_back(f.first);
+        srcs.push_back(&f.second);
+    }
+    const size_t len = srcs[0]->size();
+    for (auto src: srcs)
+        if (src->size() != len)
+            throw std::invalid_argument("fragments of different sizes");
+
+    std::vector<uint8_t> a(k * k), b(k * k, 0);
+    for (size_t i = 0; i < k; i++)
+    {
+        std::copy(&matrix[rows[i] * k], &matrix[rows[i] * k] + k, &a[i * k]);
+        b[i * k + i] = 1;
+    }
+    /* Gauss-Jordan elimination, b ends up as the inverse of a */
+    for (size_t c = 0; c < k; c++)
+    {
+        size_t p = c;
+        while (p < k && !a[p * k + c]) p++;
+        if (p == k)
+            throw std::invalid_argument("singular decoding matrix");
+        if (p != c)
+            for (size_t j = 0; j < k; j++)
+            {
+                std::swap(a[p * k + j], a[c * k + j]);
+                std::swap(b[p * k + j], b[c * k + j]);
+            }
+        uint8_t s = gf.inv(a[c * k + c]);
+        for (size_t j = 0; j < k; j++)
+        {
+            a[c * k + j] = gf.mul(a[c * k + j], s);
+            b[c * k + j] = gf.mul(b[c * k + j], s);
+        }
+        for (size_t r = 0; r < k; r++)
+        {
+            if (r == c || !a[r * k + c]) continue;
+            uint8_t f = a[r * k + c];
+            gf.mul_add(&a[r * k], &a[c * k], f, k);
+            gf.mul_add(&b[r * k], &b[c * k], f, k);
+        }
+    }
+
+    bytearray_t data(k * len, 0);
+    for (size_t j = 0; j < k; j++)
+        for (size_t i = 0; i < k; i++)
+            gf.mul_add(&data[j * len], srcs[i]->data(), b[j * k + i], len);
+    if (size > data.size())
+        throw std::invalid_argument("fragments too short for the data");
+    data.resize(size);
+    return data;
+}
+
+uint256_t MerkleTree::build(const std::vector<bytearray_t> &leaves,
+                            std::vector<std::vector<uint256_t>> &proofs) {
+    if (leaves.empty())
+        throw std::invalid_argument("no leaves for the Merkle tree");
+    std::vector<uint256_t> level;
+    for (const auto &leaf: leaves) level.push_back(hash_leaf(leaf));
+    proofs.assign(leaves.size(), std::vector<uint256_t>());
+    /* pos[i] is the position of leaf i's ancestor on the current level */
+    std::vector<size_t> pos(leaves.size());
+    for (size_t i = 0; i < pos.size(); i++) pos[i] = i;
+    while (level.size() > 1)
+    {
+        if (level.size() & 1) level.push_back(level.back());
+        for (size_t i = 0; i < pos.size(); i++)
+        {
+            proofs[i].push_back(level[pos[i] ^ 1]);
+            pos[i] >>= 1;
+        }
+        std::vector<uint256_t> next;
+        for (size_t i = 0; i < level.size(); i += 2)
+            next.push_back(hash_pair(level[i], level[i + 1]));
+        level = std::move(next);
+    }
+    return level[0];
+}
+
+bool MerkleTree::verify(const uint256_t &root, const bytearray_t &leaf,
+                        size_t idx, const std::vector<uint256_t> &proof) {
+    uint256_t h = hash_leaf(leaf);
+    for (const auto &sibling: proof)
+    {
+        h = idx & 1 ? hash_pair(sibling, h) : hash_pair(h, sibling);
+        idx >>= 1;
+    }
+    return idx == 0 && h == root;
+}
+
+size_t MerkleTree::proof_size(size_t nleaves) {
+    size_t depth = 0;
+    for (size_t width = nleaves; width > 1; width = (width + 1) / 2) depth++;
+    return depth;
+}
+
+}
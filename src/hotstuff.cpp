@@ -17,6 +17,8 @@
 
 #include "hotstuff/hotstuff.h"
 
+#include <algorithm>
+#include <cmath>
 #include <random>
 #include <future>
 #include "hotstuff/client.h"
@@ -30,19 +32,47 @@ using salticidae::static_pointer_cast;
 
 namespace hotstuff {
 
+/** Reads a count of `elem_size`-byte elements and refuses the ones the rest
+ * of the stream cannot hold, before anything is allocated for them. */
+static uint32_t get_count(DataStream &s, size_t elem_size) {
+    uint32_t n;
+    s >> n;
+    n = letoh(n);
+    if (n > s.size() / elem_size)
+        throw std::invalid_argument("ill-formed message: too many elements");
+    return n;
+}
+
+/* bytes of a serialized uint256_t */
+static const size_t hash_size = 32;
+
 const opcode_t MsgPropose::opcode;
-MsgPropose::MsgPropose(const Proposal &proposal) { serialized << proposal; }
+MsgPropose::MsgPropose(const Proposal &proposal, uint8_t tree):
+        tree(tree), pre_parsed(false) {
+    serialized << tree << proposal;
+}
+void MsgPropose::pre_parse(HotStuffCore *hsc) {
+    HOTSTUFF_LOG_PROTO("Size of the block: %lld", serialized.size());
+    serialized >> proposer;
+    blk.unserialize(serialized, hsc);
+    pre_parsed = true;
+}
 void MsgPropose::postponed_parse(HotStuffCore *hsc) {
+    if (!pre_parsed) pre_parse(hsc);
     proposal.hsc = hsc;
-    HOTSTUFF_LOG_PROTO("Size of the block: %lld", serialized.size());
-    serialized >> proposal;
+    proposal.proposer = proposer;
+    proposal.blk = hsc->storage->add_blk(std::move(blk), hsc->get_config());
 }
 
 const opcode_t MsgRelay::opcode;
-MsgRelay::MsgRelay(const VoteRelay &proposal) { serialized << proposal; }
-void MsgRelay::postponed_parse(HotStuffCore *hsc) {
+MsgRelay::MsgRelay(const VoteRelay &proposal): pre_parsed(false) { serialized << proposal; }
+void MsgRelay::pre_parse(HotStuffCore *hsc) {
     vote.hsc = hsc;
     serialized >> vote;
+    pre_parsed = true;
+}
+void MsgRelay::postponed_parse(HotStuffCore *hsc) {
+    if (!pre_parsed) pre_parse(hsc);
 }
 
 const opcode_t MsgVote::opcode;
@@ -68,26 +98,221 @@ MsgReqBlock::MsgReqBlock(DataStream &&s) {
 }
 
 const opcode_t MsgRespBlock::opcode;
-MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks) {
+MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks): pre_parsed(false) {
     serialized << htole((uint32_t)blks.size());
     for (auto blk: blks) serialized << *blk;
 }
 
-void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
+void MsgRespBlock::pre_parse(HotStuffCore *hsc) {
     uint32_t size;
     serialized >> size;
     size = letoh(size);
-    blks.resize(size);
-    for (auto &blk: blks)
+    parsed_blks.resize(size);
+    for (auto &blk: parsed_blks)
+        blk.unserialize(serialized, hsc);
+    pre_parsed = true;
+}
+
+void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
+    if (!pre_parsed) pre_parse(hsc);
+    blks.clear();
+    for (auto &blk: parsed_blks)
+        blks.push_back(hsc->storage->add_blk(std::move(blk), hsc->get_config()));
+    parsed_blks.clear();
+}
+
+const opcode_t MsgReconfig::opcode;
+MsgReconfig::MsgReconfig(uint32_t epoch, uint32_t base_epoch, uint32_t height,
+                        const std::vector<uint32_t> &rtts):
+        epoch(epoch), base_epoch(base_epoch), height(height), rtts(rtts) {
+    serialized << htole(epoch) << htole(base_epoch) << htole(height)
+                << htole((uint32_t)rtts.size());
+    for (auto rtt: rtts) serialized << htole(rtt);
+}
+
+MsgReconfig::MsgReconfig(DataStream &&s) {
+    s >> epoch >> base_epoch >> height;
+    epoch = letoh(epoch);
+    base_epoch = letoh(base_epoch);
+    height = letoh(height);
+    rtts.resize(get_count(s, sizeof(uint32_t)));
+    for (auto &rtt: rtts)
+    {
+        s >> rtt;
+        rtt = letoh(rtt);
+    }
+}
+
+const opcode_t MsgPing::opcode;
+MsgPing::MsgPing(uint64_t ts): ts(ts) { serialized << htole(ts); }
+MsgPing::MsgPing(DataStream &&s) { s >> ts; ts = letoh(ts); }
+
+const opcode_t MsgPong::opcode;
+MsgPong::MsgPong(uint64_t ts): ts(ts) { serialized << htole(ts); }
+MsgPong::MsgPong(DataStream &&s) { s >> ts; ts = letoh(ts); }
+
+const opcode_t MsgRttReport::opcode;
+MsgRttReport::MsgRttReport(const std::vector<uint32_t> &rtts): rtts(rtts) {
+    serialized << htole((uint32_t)rtts.size());
+    for (auto rtt: rtts) serialized << htole(rtt);
+}
+
+MsgRttReport::MsgRttReport(DataStream &&s) {
+    rtts.resize(get_count(s, sizeof(uint32_t)));
+    for (auto &rtt: rtts)
     {
-        Block _blk;
-        _blk.unserialize(serialized, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        s >> rtt;
+        rtt = letoh(rtt);
     }
 }
 
-void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
-    cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
+const opcode_t MsgProposeChunk::opcode;
+MsgProposeChunk::MsgProposeChunk(uint8_t tree, const uint256_t &digest,
+                                uint32_t idx, uint32_t nchunks,
+                                const uint8_t *begin, const uint8_t *end):
+        tree(tree), digest(digest), idx(idx), nchunks(nchunks) {
+    serialized << tree << digest << htole(idx) << htole(nchunks);
+    serialized.put_data(begin, end);
+}
+
+void MsgProposeChunk::parse_header() {
+    serialized >> tree >> digest >> idx >> nchunks;
+    idx = letoh(idx);
+    nchunks = letoh(nchunks);
+}
+
+const opcode_t MsgFragments::opcode;
+MsgFragments::MsgFragments(uint8_t tree, bool relay, const uint256_t &digest,
+                        const uint256_t &root, uint32_t size,
+                        const std::vector<Fragment> &frags):
+        tree(tree), relay(relay), digest(digest), root(root), size(size), frags(frags) {
+    serialized << tree << (uint8_t)relay << digest << root
+                << htole(size) << htole((uint32_t)frags.size());
+    for (const auto &f: frags)
+    {
+        serialized << htole(f.idx) << htole((uint32_t)f.data.size());
+        serialized.put_data(f.data.data(), f.data.data() + f.data.size());
+        serialized << htole((uint32_t)f.proof.size());
+        for (const auto &h: f.proof) serialized << h;
+    }
+}
+
+MsgFragments::MsgFragments(DataStream &&s) {
+    uint8_t _relay;
+    s >> tree >> _relay >> digest >> root >> size;
+    relay = _relay;
+    size = letoh(size);
+    /* index, data length and proof length */
+    frags.resize(get_count(s, 3 * sizeof(uint32_t)));
+    for (auto &f: frags)
+    {
+        uint32_t len;
+        s >> f.idx >> len;
+        f.idx = letoh(f.idx);
+        len = letoh(len);
+        if (len > s.size())
+            throw std::invalid_argument("ill-formed message: fragment too long");
+        auto base = s.get_data_inplace(len);
+        f.data = bytearray_t(base, base + len);
+        f.proof.resize(get_count(s, hash_size));
+        for (auto &h: f.proof) s >> h;
+    }
+}
+
+const opcode_t MsgBatch::opcode;
+MsgBatch::MsgBatch(bool relay, const std::vector<uint256_t> &cmds):
+        relay(relay), cmds(cmds) {
+    serialized << (uint8_t)relay << htole((uint32_t)cmds.size());
+    for (const auto &cmd: cmds) serialized << cmd;
+}
+
+MsgBatch::MsgBatch(DataStream &&s) {
+    uint8_t _relay;
+    s >> _relay;
+    relay = _relay;
+    cmds.resize(get_count(s, hash_size));
+    for (auto &cmd: cmds) s >> cmd;
+}
+
+const opcode_t MsgReqBatch::opcode;
+MsgReqBatch::MsgReqBatch(const std::vector<uint256_t> &digests): digests(digests) {
+    serialized << htole((uint32_t)digests.size());
+    for (const auto &h: digests) serialized << h;
+}
+
+MsgReqBatch::MsgReqBatch(DataStream &&s) {
+    digests.resize(get_count(s, hash_size));
+    for (auto &h: digests) s >> h;
+}
+
+const opcode_t MsgForwardCmds::opcode;
+MsgForwardCmds::MsgForwardCmds(const std::vector<uint256_t> &cmds,
+                            const std::vector<uint32_t> &sizes):
+        cmds(cmds), sizes(sizes) {
+    serialized << htole((uint32_t)cmds.size());
+    for (size_t i = 0; i < cmds.size(); i++)
+        serialized << cmds[i] << htole(sizes[i]);
+}
+
+MsgForwardCmds::MsgForwardCmds(DataStream &&s) {
+    /* a command hash and its size */
+    uint32_t size = get_count(s, hash_size + sizeof(uint32_t));
+    cmds.resize(size);
+    sizes.resize(size);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        s >> cmds[i] >> sizes[i];
+        sizes[i] = letoh(sizes[i]);
+    }
+}
+
+static uint256_t get_batch_digest(const std::vector<uint256_t> &cmds) {
+    DataStream s;
+    s << htole((uint32_t)cmds.size());
+    for (const auto &cmd: cmds) s << cmd;
+    salticidae::SHA256 d;
+    d.update(s.data(), s.size());
+    return uint256_t(d.digest());
+}
+
+/** Runs the part of parsing a message that does not touch the storage. */
+template<typename M>
+class ParseTask: public VeriTask {
+    std::shared_ptr<M> msg;
+    HotStuffCore *hsc;
+
+    public:
+    ParseTask(const std::shared_ptr<M> &msg, HotStuffCore *hsc): msg(msg), hsc(hsc) {}
+
+    bool verify() override {
+        try {
+            msg->pre_parse(hsc);
+            return true;
+        } catch (std::exception &e) {
+            HOTSTUFF_LOG_WARN("cannot parse message: %s", e.what());
+            return false;
+        }
+    }
+};
+
+template<typename M>
+void HotStuffBase::parse_async(M &&msg, const Net::conn_t &conn,
+                            void (HotStuffBase::*handler)(M &&, const Net::conn_t &)) {
+    auto m = std::make_shared<M>(std::move(msg));
+    vpool.verify(veritask_ut(new ParseTask<M>(m, this))).then([this, m, conn, handler](bool ok) {
+        if (ok) (this->*handler)(std::move(*m), conn);
+    });
+}
+
+static uint64_t now_us() {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback, size_t cmd_size) {
+    cmd_backlog.fetch_add(1, std::memory_order_relaxed);
+    cmd_pending.enqueue(PendingCmd{cmd_hash, std::move(callback), cmd_size ? cmd_size : 32});
 }
 
 void HotStuffBase::on_fetch_blk(const block_t &blk) {
@@ -105,6 +330,31 @@ void HotStuffBase::on_fetch_blk(const block_t &blk) {
         it->second.resolve(blk);
         blk_fetch_waiting.erase(it);
     }
+    on_blk_arrival(blk);
+}
+
+promise_t HotStuffBase::async_blk_arrival(const uint256_t &blk_hash) {
+    auto it = blk_arrival_waiting.find(blk_hash);
+    if (it != blk_arrival_waiting.end())
+        return it->second;
+    if (blk_arrival_order.size() >= max_parked_blks)
+    {
+        /* never proposed, or lost: the votes are useless anyway */
+        blk_arrival_waiting.erase(blk_arrival_order.front());
+        blk_arrival_order.pop_front();
+    }
+    it = blk_arrival_waiting.insert(std::make_pair(blk_hash, promise_t([](promise_t){}))).first;
+    blk_arrival_order.push_back(blk_hash);
+    return it->second;
+}
+
+void HotStuffBase::on_blk_arrival(const block_t &blk) {
+    auto it = blk_arrival_waiting.find(blk->get_hash());
+    if (it == blk_arrival_waiting.end()) return;
+    promise_t pm = it->second;
+    blk_arrival_waiting.erase(it);
+    blk_arrival_order.erase(std::find(blk_arrival_order.begin(), blk_arrival_order.end(), blk->get_hash()));
+    pm.resolve(blk);
 }
 
 bool HotStuffBase::on_deliver_blk(const block_t &blk) {
@@ -200,6 +450,10 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash, const PeerI
         /* the parents should be delivered */
         for (const auto &phash: blk->get_parent_hashes())
             pms.push_back(async_deliver_blk(phash, replica));
+        /* the block lists batch digests, their commands are needed to decide it */
+        if (batch_size)
+            for (const auto &digest: blk->get_cmds())
+                pms.push_back(async_fetch_batch(digest, replica));
         promise::all(pms).then([this, blk](const promise::values_t values) {
             auto ret = promise::any_cast<bool>(values[0]) && this->on_deliver_blk(blk);
             if (!ret)
@@ -212,62 +466,413 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash, const PeerI
 void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
     const PeerId &peer = conn->get_peer_id();
     if (peer.is_null()) return;
-    auto stream = msg.serialized;
+    msg.serialized >> msg.tree;
+    if (msg.tree >= trees.size()) return;
+
+    const auto &children = trees[msg.tree].children;
+    if (!children.empty()) {
+        /* leaves copy nothing, internal nodes copy the block once into a
+         * relay that is serialized once for all children, while the
+         * original stream is parsed in place */
+        DataStream relay;
+        relay << msg.tree;
+        relay.put_data(msg.serialized.data(), msg.serialized.data() + msg.serialized.size());
+        pn.multicast_msg(MsgPropose(std::move(relay)),
+                         std::vector<PeerId>(children.begin(), children.end()));
+    }
+
+    /* parsing and validation wait until the frames already received have
+     * been dispatched, so that a burst of proposals is relayed first */
+    prop_pending.enqueue(PendingProposal{peer, msg.tree, std::move(msg.serialized)});
+}
+
+void HotStuffBase::propose_chunk_handler(MsgProposeChunk &&msg, const Net::conn_t &conn) {
+    const PeerId &peer = conn->get_peer_id();
+    if (peer.is_null()) return;
+    msg.parse_header();
+    if (msg.tree >= trees.size() || msg.idx >= msg.nchunks || msg.nchunks > max_nchunks) return;
+    /* the chunks of a block come down its tree, so the count an assembly is
+     * made for is the parent's */
+    if (peer != trees[msg.tree].parent) return;
+    const uint8_t *begin = msg.serialized.data();
+    const uint8_t *end = begin + msg.serialized.size();
+
+    /* cut-through: a chunk goes down the tree before the rest has arrived */
+    const auto &children = trees[msg.tree].children;
+    if (!children.empty())
+        pn.multicast_msg(MsgProposeChunk(msg.tree, msg.digest, msg.idx, msg.nchunks, begin, end),
+                         std::vector<PeerId>(children.begin(), children.end()));
+
+    auto it = chunk_assemblies.find(msg.digest);
+    if (it == chunk_assemblies.end())
+    {
+        if (chunk_order.size() >= max_chunk_assemblies)
+        {
+            chunk_assemblies.erase(chunk_order.front());
+            chunk_order.pop_front();
+        }
+        it = chunk_assemblies.insert(std::make_pair(msg.digest, ChunkAssembly())).first;
+        it->second.chunks.resize(msg.nchunks);
+        it->second.received.resize(msg.nchunks, false);
+        chunk_order.push_back(msg.digest);
+    }
+    auto &a = it->second;
+    if (a.chunks.size() != msg.nchunks || a.received[msg.idx]) return;
+    a.chunks[msg.idx] = bytearray_t(begin, end);
+    a.received[msg.idx] = true;
+    if (++a.nreceived < msg.nchunks) return;
+
+    DataStream s;
+    for (const auto &chunk: a.chunks)
+        s.put_data(chunk.data(), chunk.data() + chunk.size());
+    chunk_assemblies.erase(it);
+    chunk_order.erase(std::find(chunk_order.begin(), chunk_order.end(), msg.digest));
+
+    salticidae::SHA256 d;
+    d.update(s.data(), s.size());
+    if (uint256_t(d.digest()) != msg.digest)
+    {
+        HOTSTUFF_LOG_WARN("reassembled proposal %.10s does not match its hash",
+                        get_hex(msg.digest).c_str());
+        return;
+    }
+    prop_pending.enqueue(PendingProposal{peer, msg.tree, std::move(s)});
+}
 
-    if (!childPeers.empty()) {
-        MsgPropose relay = MsgPropose(stream, true);
-        for (const PeerId &peerId : childPeers) {
-            pn.send_msg(relay, peerId);
+void HotStuffBase::send_fragments(uint8_t tree, const uint256_t &digest, const uint256_t &root,
+                                uint32_t size, const std::vector<Fragment> &frags) {
+    std::unordered_map<uint32_t, const Fragment *> by_idx;
+    for (const auto &f: frags) by_idx[f.idx] = &f;
+    for (const auto &c: trees[tree].child_subtree)
+    {
+        std::vector<Fragment> sub;
+        for (auto r: c.second)
+        {
+            auto it = by_idx.find(r);
+            if (it != by_idx.end()) sub.push_back(*it->second);
+        }
+        if (!sub.empty())
+            pn.send_msg(MsgFragments(tree, true, digest, root, size, sub), c.first);
+    }
+}
+
+void HotStuffBase::fragments_handler(MsgFragments &&msg, const Net::conn_t &conn) {
+    const PeerId &peer = conn->get_peer_id();
+    if (peer.is_null() || rs == nullptr) return;
+    if (msg.tree >= trees.size() || msg.frags.size() > rs->get_n()) return;
+    /* the proposer has the block already */
+    if (id == pmaker->get_proposer()) return;
+    const size_t proof_size = MerkleTree::proof_size(rs->get_n());
+    std::vector<Fragment> valid;
+    for (auto &f: msg.frags)
+        if (f.idx < rs->get_n() && f.proof.size() == proof_size &&
+            MerkleTree::verify(msg.root, f.data, f.idx, f.proof))
+            valid.push_back(std::move(f));
+    if (msg.relay)
+    {
+        send_fragments(msg.tree, msg.digest, msg.root, msg.size, valid);
+        /* this replica's own fragment goes to everybody else */
+        for (const auto &f: valid)
+        {
+            if (f.idx != id) continue;
+            const auto &proposer = replica_peers[pmaker->get_proposer()];
+            std::vector<PeerId> others;
+            for (const auto &p: peers)
+                if (p != proposer) others.push_back(p);
+            multicast_lazy(MsgFragments(msg.tree, false, msg.digest, msg.root, msg.size,
+                                        std::vector<Fragment>{f}), others);
+        }
+    }
+
+    /* the fragments are bound to their root, a forged digest or size under
+     * the same root starts an assembly of its own instead of spoiling this
+     * one */
+    DataStream key_s;
+    key_s << msg.root << msg.digest << htole(msg.size);
+    salticidae::SHA256 key_d;
+    key_d.update(key_s.data(), key_s.size());
+    const uint256_t key(key_d.digest());
+    auto it = fragment_assemblies.find(key);
+    if (it == fragment_assemblies.end())
+    {
+        if (fragment_order.size() >= max_fragment_assemblies)
+        {
+            fragment_assemblies.erase(fragment_order.front());
+            fragment_order.pop_front();
         }
+        FragmentAssembly a;
+        a.tree = msg.tree;
+        it = fragment_assemblies.insert(std::make_pair(key, std::move(a))).first;
+        fragment_order.push_back(key);
     }
+    auto &a = it->second;
+    if (a.done) return;
+    for (auto &f: valid)
+        a.frags.insert(std::make_pair(f.idx, std::move(f.data)));
+    if (a.frags.size() < rs->get_k()) return;
+
+    /* the finished entry stays to ignore the fragments still coming */
+    a.done = true;
+    bytearray_t data;
+    try {
+        data = rs->decode(a.frags, msg.size);
+    } catch (std::invalid_argument &e) {
+        HOTSTUFF_LOG_WARN("cannot decode proposal %.10s: %s",
+                        get_hex(msg.digest).c_str(), e.what());
+        return;
+    }
+    a.frags.clear();
+    salticidae::SHA256 d;
+    d.update(data);
+    if (uint256_t(d.digest()) != msg.digest)
+    {
+        HOTSTUFF_LOG_WARN("decoded proposal %.10s does not match its hash",
+                        get_hex(msg.digest).c_str());
+        return;
+    }
+    DataStream s;
+    s.put_data(data.data(), data.data() + data.size());
+    const auto &parent = trees[a.tree].parent;
+    prop_pending.enqueue(PendingProposal{parent.is_null() ? peer : parent, a.tree, std::move(s)});
+}
+
+std::vector<uint256_t> HotStuffBase::disseminate_batches(std::vector<uint256_t> &&cmds) {
+    std::vector<uint256_t> digests;
+    for (size_t i = 0; i < cmds.size(); i += batch_size)
+    {
+        std::vector<uint256_t> batch(cmds.begin() + i,
+                                    cmds.begin() + std::min(i + batch_size, cmds.size()));
+        uint256_t digest = get_batch_digest(batch);
+        /* every batch has another replica as its worker, so the payload is
+         * spread over everybody's uplink instead of the tree's; blocks with
+         * fewer batches than peers carry on where the last one stopped */
+        if (!peers.empty())
+            send_lazy(MsgBatch(true, batch), peers[batch_worker++ % peers.size()]);
+        batches[digest] = std::move(batch);
+        digests.push_back(digest);
+    }
+    return digests;
+}
 
+promise_t HotStuffBase::async_fetch_batch(const uint256_t &digest, const PeerId &replica) {
+    if (batches.count(digest))
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    auto it = batch_waiting.find(digest);
+    if (it == batch_waiting.end())
+    {
+        it = batch_waiting.insert(std::make_pair(digest, BatchFetch())).first;
+        /* the worker usually gets it here first, ask `replica` otherwise,
+         * then the others in turn: any of them may have it */
+        it->second.timer = TimerEvent(ec, [this, digest, replica](TimerEvent &te) {
+            size_t n = batch_waiting.at(digest).nasked++;
+            const PeerId &from = n == 0 || peers.empty() ?
+                replica : peers[(n - 1) % peers.size()];
+            send_lazy(MsgReqBatch(std::vector<uint256_t>{digest}), from);
+            te.add(batch_fetch_delay);
+        });
+        it->second.timer.add(batch_fetch_delay);
+    }
+    return it->second.pm;
+}
+
+void HotStuffBase::batch_handler(MsgBatch &&msg, const Net::conn_t &conn) {
+    const PeerId &peer = conn->get_peer_id();
+    if (peer.is_null() || msg.cmds.size() > batch_size) return;
+    uint256_t digest = get_batch_digest(msg.cmds);
+    if (batches.count(digest)) return;
+    if (msg.relay)
+    {
+        /* only the proposer makes a replica the worker of a batch */
+        if (peer != replica_peers[pmaker->get_proposer()]) return;
+        std::vector<PeerId> others;
+        for (const auto &p: peers)
+            if (p != peer) others.push_back(p);
+        multicast_lazy(MsgBatch(false, msg.cmds), others);
+    }
+    batches[digest] = std::move(msg.cmds);
+    auto it = batch_waiting.find(digest);
+    if (it != batch_waiting.end())
+    {
+        auto pm = it->second.pm;
+        it->second.timer.del();
+        batch_waiting.erase(it);
+        pm.resolve(true);
+    }
+}
+
+void HotStuffBase::req_batch_handler(MsgReqBatch &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null()) return;
+    for (const auto &digest: msg.digests)
+    {
+        auto it = batches.find(digest);
+        if (it != batches.end())
+            pn.send_msg(MsgBatch(false, it->second), replica);
+    }
+}
+
+void HotStuffBase::forward_cmds_handler(MsgForwardCmds &&msg, const Net::conn_t &conn) {
+    if (conn->get_peer_id().is_null()) return;
+    /* the forwarding replica answers the client, there is nobody to answer
+     * here; if this replica is not the proposer (any more), the commands
+     * are passed on rather than dropped, nobody would resubmit them */
+    for (size_t i = 0; i < msg.cmds.size(); i++)
+        exec_command(msg.cmds[i], nullptr, msg.sizes[i]);
+}
+
+void HotStuffBase::flush_forwarded() {
+    fwd_timer.del();
+    if (fwd_cmds.empty()) return;
+    ReplicaID proposer = pmaker->get_proposer();
+    if (proposer == get_id())
+    {
+        /* became the proposer in the meantime */
+        for (size_t i = 0; i < fwd_cmds.size(); i++)
+            exec_command(fwd_cmds[i], nullptr, fwd_sizes[i]);
+    }
+    else
+        send_lazy(MsgForwardCmds(fwd_cmds, fwd_sizes), replica_peers[proposer]);
+    fwd_cmds.clear();
+    fwd_sizes.clear();
+}
+
+void HotStuffBase::flush_outboxes() {
+    coalesce_armed = false;
+    for (auto &out: outboxes)
+        if (out.second.size())
+            ctl_net().send_msg(MsgBundle(std::move(out.second)), out.first);
+    outboxes.clear();
+}
+
+void HotStuffBase::bundle_handler(MsgBundle &&msg, const Net::conn_t &conn) {
+    auto &s = msg.serialized;
+    /* check the framing first: a bundle whose lengths do not add up is
+     * dropped as a whole rather than handed on in part */
+    struct Entry {
+        opcode_t opcode;
+        const uint8_t *base;
+        uint32_t len;
+    };
+    std::vector<Entry> entries;
+    while (s.size())
+    {
+        Entry e;
+        if (s.size() < sizeof(e.opcode) + sizeof(e.len))
+        {
+            HOTSTUFF_LOG_WARN("truncated bundle from %s", get_hex10(conn->get_peer_id()).c_str());
+            return;
+        }
+        s >> e.opcode >> e.len;
+        e.len = letoh(e.len);
+        if (e.len > s.size())
+        {
+            HOTSTUFF_LOG_WARN("truncated bundle from %s", get_hex10(conn->get_peer_id()).c_str());
+            return;
+        }
+        e.base = s.get_data_inplace(e.len);
+        entries.push_back(e);
+    }
+    for (const auto &e: entries)
+    {
+        auto it = bundled_handlers.find(e.opcode);
+        if (it == bundled_handlers.end())
+        {
+            HOTSTUFF_LOG_WARN("unexpected opcode %d in a bundle", (int)e.opcode);
+            continue;
+        }
+        DataStream payload;
+        payload.put_data(e.base, e.base + e.len);
+        it->second(std::move(payload), conn);
+    }
+}
+
+void HotStuffBase::on_relayed_proposal(PendingProposal &&p) {
+    auto msg = std::make_shared<MsgPropose>(std::move(p.serialized));
+    if (async_parse)
+    {
+        vpool.verify(veritask_ut(new ParseTask<MsgPropose>(msg, this))).then(
+                [this, msg, peer = p.peer, tree = p.tree](bool ok) {
+            if (ok) deliver_proposal(*msg, peer, tree);
+        });
+        return;
+    }
+    deliver_proposal(*msg, p.peer, p.tree);
+}
+
+void HotStuffBase::deliver_proposal(MsgPropose &msg, const PeerId &peer, uint8_t tree) {
     msg.postponed_parse(this);
     auto &prop = msg.proposal;
 
     block_t blk = prop.blk;
     if (!blk) return;
-
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(blk->get_hash(), peer)
-    }).then([this, prop = std::move(prop)]() {
+    blk->tree = tree;
+    on_blk_arrival(blk);
+
+    std::vector<promise_t> pms{async_deliver_blk(blk->get_hash(), peer)};
+    /* vote only once the payload is here as well */
+    if (batch_size && prop.proposer < replica_peers.size())
+        for (const auto &digest: blk->get_cmds())
+            pms.push_back(async_fetch_batch(digest, replica_peers[prop.proposer]));
+    promise::all(pms).then([this, prop = std::move(prop)]() {
         on_receive_proposal(prop);
     });
 }
 
 void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
-    struct timeval timeStart,timeEnd;
-    gettimeofday(&timeStart, NULL);
-
     const auto &peer = conn->get_peer_id();
     if (peer.is_null()) return;
     msg.postponed_parse(this);
     //HOTSTUFF_LOG_PROTO("received vote");
+    if (storage->find_blk(msg.vote.blk_hash) == nullptr)
+    {
+        /* the vote overtook its proposal, which is still being parsed */
+        auto vote = std::make_shared<Vote>(std::move(msg.vote));
+        async_blk_arrival(vote->blk_hash).then([this, vote, peer]() {
+            on_vote(std::move(*vote), peer);
+        });
+        return;
+    }
+    on_vote(std::move(msg.vote), peer);
+}
+
+void HotStuffBase::on_vote(Vote &&vote, const PeerId &peer) {
+    struct timeval timeStart,timeEnd;
+    gettimeofday(&timeStart, NULL);
 
-    if (id == pmaker->get_proposer() && !piped_queue.empty() && std::find(piped_queue.begin(), piped_queue.end(), msg.vote.blk_hash) != piped_queue.end()) {
+    if (id == pmaker->get_proposer() && piped_window.contains(vote.blk_hash)) {
         HOTSTUFF_LOG_PROTO("piped block");
-        block_t blk = storage->find_blk(msg.vote.blk_hash);
+        block_t blk = storage->find_blk(vote.blk_hash);
         if (!blk->delivered) {
             process_block(blk, false);
             HOTSTUFF_LOG_PROTO("Normalized piped block");
         }
     }
 
-    block_t blk = get_potentially_not_delivered_blk(msg.vote.blk_hash);
+    block_t blk = storage->find_blk(vote.blk_hash);
+    /* left over from a previous tree */
+    const auto &children = tree_of(blk).children;
+    if (children.find(peer) == children.end()) return;
+    /* a child votes for itself only, its subtree comes in its relays */
+    if (vote.voter >= replica_peers.size() || replica_peers[vote.voter] != peer)
+    {
+        LOG_WARN("dropping a vote for %d from another replica", vote.voter);
+        return;
+    }
 
     if (!blk->delivered && blk->self_qc == nullptr) {
         blk->self_qc = create_quorum_cert(blk->get_hash());
         part_cert_bt part = create_part_cert(*priv_key, blk->get_hash());
         blk->self_qc->add_part(config, id, *part);
 
-        std::cout << "create cert: " << msg.vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
+        std::cout << "create cert: " << vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
     }
 
-    std::cout << "vote handler: " << msg.vote.blk_hash.to_hex() << " " << std::endl;
+    std::cout << "vote handler: " << vote.blk_hash.to_hex() << " " << std::endl;
     //HOTSTUFF_LOG_PROTO("vote handler %d %d", config.nmajority, config.nreplicas);
 
     if (blk->self_qc->has_n(config.nmajority)) {
         HOTSTUFF_LOG_PROTO("bye vote handler");
-        //std::cout << "bye vote handler: " << msg.vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
+        //std::cout << "bye vote handler: " << vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
         /*if (id == get_pace_maker()->get_proposer()) {
             gettimeofday(&timeEnd, NULL);
             long usec = ((timeEnd.tv_sec - timeStart.tv_sec) * 1000000 + timeEnd.tv_usec - timeStart.tv_usec);
@@ -278,10 +883,12 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     }
 
     //auto &vote = msg.vote;
-    RcObj<Vote> v(new Vote(std::move(msg.vote)));
+    RcObj<Vote> v(new Vote(std::move(vote)));
+    /* internal nodes may defer the check to the aggregate of their subtree */
+    bool optimistic = config.optimistic_verify && id != pmaker->get_proposer();
     promise::all(std::vector<promise_t>{
         async_deliver_blk(v->blk_hash, peer),
-        v->verify(vpool),
+        optimistic ? promise_t([](promise_t &pm) { pm.resolve(true); }) : v->verify(vpool),
     }).then([this, blk, v=std::move(v), timeStart](const promise::values_t values) {
         if (!promise::any_cast<bool>(values[1]))
             LOG_WARN("invalid vote from %d", v->voter);
@@ -290,29 +897,59 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
 
       if (id != pmaker->get_proposer() ) {
 
-        if (cert->has_n(numberOfChildren + 1)) {
+        if (subtree_complete(blk)) {
+          return;
+        }
+        /* already in through a relay, counting it again would overlap */
+        if (cert->has_part(v->voter)) {
+          return;
+        }
+
+        if (on_child_contribution(blk)) {
+          /* the deadline has passed, top up the parent with this vote only */
+          if (config.optimistic_verify && !v->verify()) {
+            LOG_WARN("invalid vote from %d", v->voter);
+            return;
+          }
+          cert->add_part(config, v->voter, *v->cert);
+          quorum_cert_bt delta(create_quorum_cert(blk->get_hash()));
+          delta->add_part(config, v->voter, *v->cert);
+          delta->compute();
+          send_coalesced(MsgRelay(VoteRelay(v->blk_hash, std::move(delta), this)), tree_of(blk).parent);
           return;
         }
 
-        cert->add_part(config, v->voter, *v->cert);
+        if (config.optimistic_verify) {
+          auto ov = optimistic_votes.find(blk->get_hash());
+          if (ov == optimistic_votes.end())
+          {
+            prune_agg_state(blk->get_height());
+            ov = optimistic_votes.insert(std::make_pair(blk->get_hash(),
+                    OptimisticVotes{blk->get_height(), {}})).first;
+          }
+          auto &votes = ov->second.votes;
+          for (const auto &vote: votes)
+            if (vote.voter == v->voter) return;
+          votes.push_back(*v);
+        }
+        else
+          cert->add_part(config, v->voter, *v->cert);
 
-        if (!cert->has_n(numberOfChildren + 1)) {
+        if (!subtree_complete(blk)) {
           return;
         }
         std::cout <<  " got enough votes: " << v->blk_hash.to_hex().c_str() <<  std::endl;
 
-        if (!piped_queue.empty()) {
+        if (!piped_window.empty()) {
 
-          for (auto hash = std::begin(piped_queue); hash != std::end(piped_queue); ++hash) {
-            block_t b = storage->find_blk(*hash);
-            if (b->delivered && b->qc->has_n(config.nmajority)) {
-              piped_queue.erase(hash);
-              HOTSTUFF_LOG_PROTO("Confirm Piped block");
-            }
-          }
+          piped_window.erase_if([this](const block_t &b) {
+            if (!b->delivered || !b->qc->has_n(config.nmajority)) return false;
+            HOTSTUFF_LOG_PROTO("Confirm Piped block");
+            return true;
+          });
 
-          if (blk->hash == piped_queue.front()){
-            piped_queue.pop_front();
+          if (!piped_window.empty() && blk->hash == piped_window.front()->hash){
+            piped_window.pop_front();
             HOTSTUFF_LOG_PROTO("Reset Piped block");
           }
           else {
@@ -321,17 +958,24 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
         }
 
         cert->compute();
-        if (!cert->verify(config)) {
+        if (config.optimistic_verify ? !verify_optimistic_votes(blk) : !cert->verify(config)) {
           HOTSTUFF_LOG_PROTO("Error, Invalid Sig!!!");
           return;
         }
+        disarm_agg_deadline(blk->get_hash());
 
         std::cout <<  " send relay message: " << v->blk_hash.to_hex().c_str() <<  std::endl;
-        pn.send_msg(MsgRelay(VoteRelay(v->blk_hash, blk->self_qc->clone(), this)), parentPeer);
+        send_coalesced(MsgRelay(VoteRelay(v->blk_hash, blk->self_qc->clone(), this)), tree_of(blk).parent);
         return;
       }
 
       cert->add_part(config, v->voter, *v->cert);
+      auto restarted = restarted_qcs.find(blk->get_hash());
+      if (restarted != restarted_qcs.end())
+      {
+        restarted->second->add_part(config, v->voter, *v->cert);
+        settle_restarted_qc(blk);
+      }
       if (cert != nullptr && cert->get_obj_hash() == blk->get_hash()) {
         if (cert->has_n(config.nmajority)) {
           cert->compute();
@@ -370,60 +1014,68 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
               << std::endl;*/
 }
 
-void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
-    struct timeval timeStart, timeEnd;
-    gettimeofday(&timeStart, NULL);
+void HotStuffBase::finish_certified_successors(const block_t &blk) {
+    for (const auto &rdy_blk: piped_window.drain_certified(blk))
+    {
+        HOTSTUFF_LOG_PROTO("Resolved certified piped block %s", rdy_blk->hash.to_hex().c_str());
+        update_hqc(rdy_blk, rdy_blk->self_qc);
+        on_qc_finish(rdy_blk);
+    }
+}
 
+void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
     const auto &peer = conn->get_peer_id();
     if (peer.is_null()) return;
+    if (async_parse && !msg.pre_parsed)
+    {
+        parse_async(std::move(msg), conn, &HotStuffBase::vote_relay_handler);
+        return;
+    }
     msg.postponed_parse(this);
     //std::cout << "vote relay handler: " << msg.vote.blk_hash.to_hex() << std::endl;
+    if (storage->find_blk(msg.vote.blk_hash) == nullptr)
+    {
+        /* the relay overtook its proposal, which is still being parsed */
+        auto vote = std::make_shared<VoteRelay>(std::move(msg.vote));
+        async_blk_arrival(vote->blk_hash).then([this, vote, peer]() {
+            on_vote_relay(std::move(*vote), peer);
+        });
+        return;
+    }
+    on_vote_relay(std::move(msg.vote), peer);
+}
+
+void HotStuffBase::on_vote_relay(VoteRelay &&vote, const PeerId &peer) {
+    struct timeval timeStart, timeEnd;
+    gettimeofday(&timeStart, NULL);
 
-    if (id == pmaker->get_proposer() && !piped_queue.empty() && std::find(piped_queue.begin(), piped_queue.end(), msg.vote.blk_hash) != piped_queue.end()) {
+    if (id == pmaker->get_proposer() && piped_window.contains(vote.blk_hash)) {
         HOTSTUFF_LOG_PROTO("piped block");
-        block_t blk = storage->find_blk(msg.vote.blk_hash);
+        block_t blk = storage->find_blk(vote.blk_hash);
         if (!blk->delivered) {
             process_block(blk, false);
             HOTSTUFF_LOG_PROTO("Normalized piped block");
         }
     }
 
-    block_t blk = get_potentially_not_delivered_blk(msg.vote.blk_hash);
+    block_t blk = storage->find_blk(vote.blk_hash);
+    /* left over from a previous tree */
+    const auto &children = tree_of(blk).children;
+    if (children.find(peer) == children.end()) return;
     if (!blk->delivered && blk->self_qc == nullptr) {
         blk->self_qc = create_quorum_cert(blk->get_hash());
         part_cert_bt part = create_part_cert(*priv_key, blk->get_hash());
         blk->self_qc->add_part(config, id, *part);
 
-        std::cout << "create cert: " << msg.vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
+        std::cout << "create cert: " << vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
     }
 
     if (blk->self_qc->has_n(config.nmajority)) {
-        std::cout << "bye vote relay handler: " << msg.vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
-        if (id == pmaker->get_proposer() && blk->hash == piped_queue.front()) {
-            piped_queue.pop_front();
+        std::cout << "bye vote relay handler: " << vote.blk_hash.to_hex() << " " << &blk->self_qc << std::endl;
+        if (id == pmaker->get_proposer() && !piped_window.empty() && blk->hash == piped_window.front()->hash) {
+            piped_window.pop_front();
             HOTSTUFF_LOG_PROTO("Reset Piped block");
-
-            if (!rdy_queue.empty()) {
-                auto curr_blk = blk;
-                bool foundChildren = true;
-                while (foundChildren) {
-                    foundChildren = false;
-                    for (const auto &hash : rdy_queue) {
-                        block_t rdy_blk = storage->find_blk(hash);
-                        if (rdy_blk->get_parent_hashes()[0] == curr_blk->hash) {
-                            HOTSTUFF_LOG_PROTO("Resolved block in rdy queue %s", hash.to_hex().c_str());
-                            rdy_queue.erase(std::find(rdy_queue.begin(), rdy_queue.end(), hash));
-                            piped_queue.erase(std::find(piped_queue.begin(), piped_queue.end(), hash));
-
-                            update_hqc(rdy_blk, rdy_blk->self_qc);
-                            on_qc_finish(rdy_blk);
-                            foundChildren = true;
-                            curr_blk = rdy_blk;
-                            break;
-                        }
-                    }
-                }
-            }
+            finish_certified_successors(blk);
         }
 
         /*if (id == get_pace_maker()->get_proposer()) {
@@ -435,10 +1087,10 @@ void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
         return;
     }
 
-    std::cout << "vote relay handler: " << msg.vote.blk_hash.to_hex() << " " << std::endl;
+    std::cout << "vote relay handler: " << vote.blk_hash.to_hex() << " " << std::endl;
 
     //auto &vote = msg.vote;
-    RcObj<VoteRelay> v(new VoteRelay(std::move(msg.vote)));
+    RcObj<VoteRelay> v(new VoteRelay(std::move(vote)));
     promise::all(std::vector<promise_t>{
             async_deliver_blk(v->blk_hash, peer),
             v->cert->verify(config, vpool),
@@ -451,22 +1103,38 @@ void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
         std::cout << "got relay and verified" << std::endl;
 
         if (cert != nullptr && cert->get_obj_hash() == blk->get_hash() && !cert->has_n(config.nmajority)) {
-            if (id != pmaker->get_proposer() && cert->has_n(numberOfChildren + 1))
+            if (id != pmaker->get_proposer() && subtree_complete(blk))
+            {
+                return;
+            }
+
+            if (id != pmaker->get_proposer() && on_child_contribution(blk))
             {
+                /* the deadline has passed, pass the late part of the subtree on as is */
+                if (!promise::any_cast<bool>(values[1])) return;
+                cert->merge_quorum(*v->cert);
+                send_coalesced(MsgRelay(VoteRelay(v->blk_hash, v->cert->clone(), this)), tree_of(blk).parent);
                 return;
             }
 
             cert->merge_quorum(*v->cert);
+            auto restarted = restarted_qcs.find(blk->get_hash());
+            if (restarted != restarted_qcs.end())
+            {
+                restarted->second->merge_quorum(*v->cert);
+                settle_restarted_qc(blk);
+            }
 
             std::cout << "merge quorum " << std::endl;
             if (id != pmaker->get_proposer()) {
-                if (!cert->has_n(numberOfChildren + 1)) return;
+                if (!subtree_complete(blk)) return;
                 cert->compute();
-                if (!cert->verify(config)) {
+                if (config.optimistic_verify ? !verify_optimistic_votes(blk) : !cert->verify(config)) {
                     throw std::runtime_error("Invalid Sigs in intermediate signature!");
                 }
+                disarm_agg_deadline(blk->get_hash());
                 std::cout << "Send Vote Relay: " << v->blk_hash.to_hex() << std::endl;
-                pn.send_msg(MsgRelay(VoteRelay(v->blk_hash, cert.get()->clone(), this)), parentPeer);
+                send_coalesced(MsgRelay(VoteRelay(v->blk_hash, cert.get()->clone(), this)), tree_of(blk).parent);
                 return;
             }
 
@@ -489,43 +1157,22 @@ void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
                 return;
             }
 
-            if (!piped_queue.empty()) {
-                if (blk->hash == piped_queue.front()) {
-                    piped_queue.pop_front();
+            if (!piped_window.empty()) {
+                if (blk->hash == piped_window.front()->hash) {
+                    piped_window.pop_front();
                     HOTSTUFF_LOG_PROTO("Reset Piped block");
 
                     std::cout << "go to town: " << std::endl;
 
                     update_hqc(blk, cert);
                     on_qc_finish(blk);
-
-                    if (!rdy_queue.empty()) {
-                        auto curr_blk = blk;
-                        bool foundChildren = true;
-                        while (foundChildren) {
-                            foundChildren = false;
-                            for (const auto &hash : rdy_queue) {
-                                block_t rdy_blk = storage->find_blk(hash);
-                                if (rdy_blk->get_parent_hashes()[0] == curr_blk->hash) {
-                                    HOTSTUFF_LOG_PROTO("Resolved block in rdy queue %s", hash.to_hex().c_str());
-                                    rdy_queue.erase(std::find(rdy_queue.begin(), rdy_queue.end(), hash));
-                                    piped_queue.erase(std::find(piped_queue.begin(), piped_queue.end(), hash));
-
-                                    update_hqc(rdy_blk, rdy_blk->self_qc);
-                                    on_qc_finish(rdy_blk);
-                                    foundChildren = true;
-                                    curr_blk = rdy_blk;
-                                    break;
-                                }
-                            }
-                        }
-                    }
+                    finish_certified_successors(blk);
                 }
                 else {
-                    auto place = std::find(piped_queue.begin(), piped_queue.end(), blk->hash);
-                    if (place != piped_queue.end()) {
-                        HOTSTUFF_LOG_PROTO("Failed resetting piped block, wasn't front! Adding to rdy_queue %s", blk->hash.to_hex().c_str());
-                        rdy_queue.push_back(blk->hash);
+                    if (piped_window.contains(blk->hash)) {
+                        HOTSTUFF_LOG_PROTO("Failed resetting piped block, wasn't front! Marking it certified %s", blk->hash.to_hex().c_str());
+                        piped_window.set_certified(blk->hash);
+                        pipe_ctl.on_stall();
 
                         // Don't finish this block until the previous one was finished.
                         return;
@@ -580,6 +1227,180 @@ void HotStuffBase::vote_relay_handler(MsgRelay &&msg, const Net::conn_t &conn) {
               << std::endl;*/
 }
 
+bool HotStuffBase::subtree_complete(const block_t &blk) {
+    uint32_t nvotes = tree_of(blk).ndescendants + 1;
+    auto it = optimistic_votes.find(blk->get_hash());
+    if (it != optimistic_votes.end())
+    {
+        const auto &votes = it->second.votes;
+        if (votes.size() >= nvotes) return true;
+        nvotes -= votes.size();
+    }
+    return blk->self_qc->has_n(nvotes);
+}
+
+bool HotStuffBase::verify_optimistic_votes(const block_t &blk) {
+    auto &cert = blk->self_qc;
+    auto it = optimistic_votes.find(blk->get_hash());
+    if (it == optimistic_votes.end())
+        return cert->verify(config);
+    std::vector<Vote> votes = std::move(it->second.votes);
+    optimistic_votes.erase(it);
+
+    quorum_cert_bt agg(cert->clone());
+    for (const auto &vote: votes)
+        agg->add_part(config, vote.voter, *vote.cert);
+    agg->compute();
+    if (agg->verify(config))
+    {
+        blk->self_qc = std::move(agg);
+        return true;
+    }
+
+    /* some child signed garbage, exclude the culprits */
+    std::vector<bool> valid(votes.size(), true);
+    blame_votes(blk->get_hash(), votes, 0, votes.size(), valid);
+    for (size_t i = 0; i < votes.size(); i++)
+    {
+        if (valid[i])
+            cert->add_part(config, votes[i].voter, *votes[i].cert);
+        else
+            LOG_WARN("invalid vote from %d", votes[i].voter);
+    }
+    cert->compute();
+    return cert->verify(config);
+}
+
+void HotStuffBase::blame_votes(const uint256_t &blk_hash, const std::vector<Vote> &votes,
+                                size_t begin, size_t end, std::vector<bool> &valid) {
+    if (end - begin == 1)
+    {
+        valid[begin] = votes[begin].verify();
+        return;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    bool blamed = false;
+    for (auto range: {std::make_pair(begin, mid), std::make_pair(mid, end)})
+    {
+        quorum_cert_bt agg = create_quorum_cert(blk_hash);
+        for (size_t i = range.first; i < range.second; i++)
+            agg->add_part(config, votes[i].voter, *votes[i].cert);
+        agg->compute();
+        if (!agg->verify(config))
+        {
+            blamed = true;
+            blame_votes(blk_hash, votes, range.first, range.second, valid);
+        }
+    }
+    if (!blamed)
+    {
+        /* both halves check out while the whole did not: invalid signatures
+         * cancelled out in the halves, so check the votes one by one */
+        for (size_t i = begin; i < end; i++)
+            valid[i] = votes[i].verify();
+    }
+}
+
+void HotStuffBase::arm_agg_deadline(const block_t &blk) {
+    const auto &blk_hash = blk->get_hash();
+    if (agg_deadlines.count(blk_hash) || subtree_complete(blk)) return;
+
+    prune_agg_state(blk->get_height());
+
+    auto &d = agg_deadlines[blk_hash];
+    gettimeofday(&d.start, nullptr);
+    d.height = blk->get_height();
+    d.forwarded = false;
+    d.timer = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+        on_agg_deadline(blk_hash);
+    });
+    /* wait for the typical child plus a margin, as for TCP retransmission */
+    d.timer.add(std::max(config.agg_timeout, agg_delay + 4 * agg_delay_var));
+}
+
+void HotStuffBase::settle_restarted_qc(const block_t &blk) {
+    auto it = restarted_qcs.find(blk->get_hash());
+    if (it == restarted_qcs.end()) return;
+    if (blk->self_qc->has_n(config.nmajority))
+        restarted_qcs.erase(it);
+    else if (it->second->has_n(config.nmajority))
+    {
+        /* the new tree got there first */
+        blk->self_qc = std::move(it->second);
+        restarted_qcs.erase(it);
+    }
+}
+
+void HotStuffBase::prune_agg_state(uint32_t height) {
+    if (height < agg_state_depth) return;
+    /* forget the blocks whose subtree never completed */
+    for (auto it = agg_deadlines.begin(); it != agg_deadlines.end();)
+    {
+        if (it->second.forwarded && it->second.height + agg_state_depth < height)
+            it = agg_deadlines.erase(it);
+        else
+            it++;
+    }
+    for (auto it = optimistic_votes.begin(); it != optimistic_votes.end();)
+    {
+        if (it->second.height + agg_state_depth < height)
+            it = optimistic_votes.erase(it);
+        else
+            it++;
+    }
+}
+
+void HotStuffBase::disarm_agg_deadline(const uint256_t &blk_hash) {
+    agg_deadlines.erase(blk_hash);
+}
+
+bool HotStuffBase::on_child_contribution(const block_t &blk) {
+    auto it = agg_deadlines.find(blk->get_hash());
+    if (it == agg_deadlines.end()) return false;
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    double delay = (now.tv_sec - it->second.start.tv_sec) +
+                    (now.tv_usec - it->second.start.tv_usec) / 1e6;
+    if (agg_delay == 0)
+    {
+        agg_delay = delay;
+        agg_delay_var = delay / 2;
+    }
+    else
+    {
+        agg_delay_var = 0.75 * agg_delay_var + 0.25 * std::abs(agg_delay - delay);
+        agg_delay = 0.875 * agg_delay + 0.125 * delay;
+    }
+    return it->second.forwarded;
+}
+
+void HotStuffBase::on_agg_deadline(uint256_t blk_hash) {
+    /* blk_hash is a copy: erasing the entry destroys the timer that
+     * called this */
+    auto it = agg_deadlines.find(blk_hash);
+    if (it == agg_deadlines.end() || it->second.forwarded) return;
+    block_t blk = storage->find_blk(blk_hash);
+    if (blk == nullptr || blk->self_qc == nullptr || subtree_complete(blk))
+    {
+        agg_deadlines.erase(it);
+        return;
+    }
+
+    auto &cert = blk->self_qc;
+    cert->compute();
+    if (config.optimistic_verify ? !verify_optimistic_votes(blk) : !cert->verify(config))
+    {
+        HOTSTUFF_LOG_PROTO("Error, Invalid Sig!!!");
+        agg_deadlines.erase(it);
+        return;
+    }
+    it->second.forwarded = true;
+    HOTSTUFF_LOG_PROTO("aggregation deadline of %.10s, relaying a partial aggregate",
+                        get_hex(blk_hash).c_str());
+    send_coalesced(MsgRelay(VoteRelay(blk_hash, cert->clone(), this)), tree_of(blk).parent);
+}
+
 void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
     const PeerId replica = conn->get_peer_id();
     if (replica.is_null()) return;
@@ -598,7 +1419,12 @@ void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
     });
 }
 
-void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &) {
+void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &conn) {
+    if (async_parse && !msg.pre_parsed)
+    {
+        parse_async(std::move(msg), conn, &HotStuffBase::resp_blk_handler);
+        return;
+    }
     msg.postponed_parse(this);
     for (const auto &blk: msg.blks)
         if (blk) on_fetch_blk(blk);
@@ -637,6 +1463,18 @@ void HotStuffBase::print_stat() const {
             part_delivery_time_min == double_inf ? 0 : part_delivery_time_min,
             part_delivery_time_max);
 
+    if (config.adaptive_pipeline)
+    {
+        LOG_INFO("-------- pipeline -----");
+        LOG_INFO("depth: %d", config.async_blocks);
+        LOG_INFO("delay: %d ms", config.piped_latency);
+        LOG_INFO("qc latency: %.3f ms", pipe_ctl.get_qc_latency());
+        LOG_INFO("block gap: %.3f ms", pipe_ctl.get_gap());
+        LOG_INFO("stalls: %lu", pipe_ctl.get_stalls());
+    }
+    if (blk_size_max)
+        LOG_INFO("blk_size: %lu", blk_size);
+
     part_parent_size = 0;
     part_fetched = 0;
     part_delivered = 0;
@@ -689,11 +1527,33 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         HotStuffCore(rid, std::move(priv_key)),
         listen_addr(listen_addr),
         blk_size(blk_size),
+        blk_size_min(1),
+        blk_size_max(0),
         ec(ec),
         tcall(ec),
         vpool(ec, nworker),
         pn(ec, netconfig),
+        pn_ctl(ec, netconfig),
         pmaker(std::move(pmaker)),
+        cmd_pending_bytes(0),
+        blk_bytes(0),
+        blk_deadline(0),
+        cmd_pending_since(0),
+        cmd_backlog(0),
+        chunk_size(0),
+        max_nchunks(0),
+        erasure_coding(false),
+        batch_size(0),
+        batch_cmd_offset(0),
+        batch_worker(0),
+        coalesce_window(-1),
+        coalesce_armed(false),
+        ctl_port_offset(0),
+        ready([](promise_t) {}),
+        is_ready(false),
+        beat_deferred(false),
+        sparse_mesh(false),
+        lazy_armed(false),
 
         fetched(0), delivered(0),
         nsent(0), nrecv(0),
@@ -704,21 +1564,91 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         part_gened(0),
         part_delivery_time(0),
         part_delivery_time_min(double_inf),
-        part_delivery_time_max(0)
+        part_delivery_time_max(0),
+        agg_delay(0), agg_delay_var(0),
+        tree_epoch(0),
+        tree_base_epoch(0),
+        reconfig_last_height(0),
+        latency_round(0),
+        async_parse(false)
 {
     /* register the handlers for msg from replicas */
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_chunk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::fragments_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_batch_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::forward_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::bundle_handler, this, _1, _2));
+    reg_bundled_handler(&HotStuffBase::vote_handler);
+    reg_bundled_handler(&HotStuffBase::vote_relay_handler);
+    coalesce_timer = TimerEvent(ec, [this](TimerEvent &) { flush_outboxes(); });
+    pn_ctl.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
+    pn_ctl.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_relay_handler, this, _1, _2));
+    pn_ctl.reg_handler(salticidae::generic_bind(&HotStuffBase::bundle_handler, this, _1, _2));
+    pn_ctl.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_relay_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::reconfig_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::ping_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::pong_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::rtt_report_handler, this, _1, _2));
     pn.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
+    prop_pending.reg_handler(ec, [this](prop_queue_t &q) {
+        PendingProposal p;
+        while (q.try_dequeue(p))
+            on_relayed_proposal(std::move(p));
+        return false;
+    });
     pn.start();
     pn.listen(listen_addr);
 }
 
 void HotStuffBase::do_broadcast_proposal(const Proposal &prop) {
-    pn.multicast_msg(MsgPropose(prop), std::vector(childPeers.begin(), childPeers.end()));
+    last_voted = prop.blk;
+    /* spread the relaying and aggregation over the trees, block by block */
+    uint8_t tree = prop.blk->get_height() % trees.size();
+    prop.blk->tree = tree;
+    const auto &children = trees[tree].children;
+    std::vector<PeerId> dests(children.begin(), children.end());
+    if (rs != nullptr)
+    {
+        DataStream s;
+        s << prop;
+        salticidae::SHA256 d;
+        d.update(s.data(), s.size());
+        auto coded = rs->encode(s.data(), s.size());
+        std::vector<std::vector<uint256_t>> proofs;
+        uint256_t root = MerkleTree::build(coded, proofs);
+        std::vector<Fragment> frags;
+        for (uint32_t i = 0; i < coded.size(); i++)
+            frags.push_back(Fragment{i, std::move(coded[i]), std::move(proofs[i])});
+        send_fragments(tree, uint256_t(d.digest()), root, s.size(), frags);
+        return;
+    }
+    if (chunk_size)
+    {
+        DataStream s;
+        s << prop;
+        if (s.size() > chunk_size)
+        {
+            salticidae::SHA256 d;
+            d.update(s.data(), s.size());
+            uint256_t digest(d.digest());
+            uint32_t nchunks = (s.size() + chunk_size - 1) / chunk_size;
+            const uint8_t *base = s.data();
+            for (uint32_t i = 0; i < nchunks; i++)
+            {
+                size_t offset = i * chunk_size;
+                pn.multicast_msg(MsgProposeChunk(tree, digest, i, nchunks, base + offset,
+                                    base + std::min(offset + chunk_size, s.size())), dests);
+            }
+            return;
+        }
+    }
+    pn.multicast_msg(MsgPropose(prop, tree), dests);
 }
 
 void HotStuffBase::do_vote(Proposal prop, const Vote &vote) {
@@ -731,17 +1661,23 @@ void HotStuffBase::do_vote(Proposal prop, const Vote &vote) {
             throw HotStuffError("unreachable line");
         }
 
-        if (childPeers.empty()) {
+        block_t blk = get_delivered_blk(vote.blk_hash);
+        if (last_voted == nullptr || blk->get_height() > last_voted->get_height())
+            last_voted = blk;
+
+        const auto &view = tree_of(blk);
+        if (view.children.empty()) {
             //HOTSTUFF_LOG_PROTO("send vote");
-            pn.send_msg(MsgVote(vote), parentPeer);
+            send_coalesced(MsgVote(vote), view.parent);
         } else {
-            block_t blk = get_delivered_blk(vote.blk_hash);
             if (blk->self_qc == nullptr)
             {
                 //HOTSTUFF_LOG_PROTO("create cert");
                 blk->self_qc = create_quorum_cert(prop.blk->get_hash());
                 blk->self_qc->add_part(config, vote.voter, *vote.cert);
             }
+            if (config.agg_timeout > 0)
+                arm_agg_deadline(blk);
         }
     });
 }
@@ -751,6 +1687,32 @@ void HotStuffBase::do_consensus(const block_t &blk) {
 }
 
 void HotStuffBase::do_decide(Finality &&fin) {
+    auto b = batch_size ? batches.find(fin.cmd_hash) : batches.end();
+    if (b != batches.end())
+    {
+        /* the batches of a block are decided in order, the commands of this
+         * one follow those of the batches before it */
+        if (fin.blk_hash != batch_offset_blk)
+        {
+            batch_offset_blk = fin.blk_hash;
+            batch_cmd_offset = 0;
+        }
+        uint32_t offset = batch_cmd_offset;
+        batch_cmd_offset += b->second.size();
+        /* the block lists a batch, decide its commands one by one */
+        const auto &cmds = b->second;
+        for (size_t i = 0; i < cmds.size(); i++)
+            do_decide(Finality(fin.rid, fin.decision, offset + i,
+                                fin.cmd_height, cmds[i], fin.blk_hash));
+        /* kept a while for the replicas that are behind */
+        decided_batches.push_back(std::make_pair(fin.cmd_height, fin.cmd_hash));
+        while (decided_batches.front().first + batch_keep_depth < fin.cmd_height)
+        {
+            batches.erase(decided_batches.front().second);
+            decided_batches.pop_front();
+        }
+        return;
+    }
     part_decided++;
     state_machine_execute(fin);
     auto it = decision_waiting.find(fin.cmd_hash);
@@ -765,15 +1727,20 @@ HotStuffBase::~HotStuffBase() {}
 
 void HotStuffBase::start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas, bool ec_loop) {
 
-    std::set<uint16_t> children;
     auto size = replicas.size();
 
-    childPeers.clear();
+    if (ctl_port_offset)
+    {
+        pn_ctl.start();
+        pn_ctl.listen(ctl_addr(listen_addr));
+    }
+    replica_peers.clear();
     for (size_t i = 0; i < size; i++) {
 
         auto cert_hash = std::move(std::get<2>(replicas[i]));
         salticidae::PeerId peer{cert_hash};
         valid_tls_certs.insert(cert_hash);
+        replica_peers.push_back(peer);
         auto &addr = std::get<0>(replicas[i]);
 
         HotStuffCore::add_replica(i, peer, std::move(std::get<1>(replicas[i])));
@@ -781,73 +1748,63 @@ void HotStuffBase::start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>>
             peers.push_back(peer);
             pn.add_peer(peer);
             pn.set_peer_addr(peer, addr);
+            peer_addrs[peer] = addr;
+            if (ctl_port_offset)
+            {
+                pn_ctl.add_peer(peer);
+                pn_ctl.set_peer_addr(peer, ctl_addr(addr));
+            }
         }
     }
 
-    size_t fanout = config.fanout;
-    auto processesOnLevel = 1;
-    bool done = false;
-
-    size_t i = 0;
-    while (i < size) { // 0 // 11
-        if (done) {
-            break;
-        }
-        const size_t remaining = size - i; // 100 // 89
-
-        const size_t max_fanout = ceil(remaining / processesOnLevel); //100 // 9
-        auto curr_fanout = std::min(max_fanout, fanout); //10 // 9
-
-        auto parent_cert_hash = std::move(std::get<2>(replicas[i]));
-        salticidae::PeerId parent_peer{parent_cert_hash};
+    build_tree(tree_epoch);
+    /* any f + 1 fragments rebuild the block */
+    if (erasure_coding)
+        rs = BoxObj<ReedSolomon>(new ReedSolomon((size - 1) / 3 + 1, size));
 
-        auto start = i + processesOnLevel; // 11
-        for (auto counter = 1; counter <= processesOnLevel; counter++) { // 1 run // 10 runs
-            if (done) {
-                break;
-            }
-            for (size_t j = start; j < start + curr_fanout; j++) { // j = 1 -> 10 // j = 11 -> 21 // (i = 11) j = 22 - 32
-                if (j >= size) {
-                    done = true;
-                    break;
-                }
-                auto cert_hash = std::move(std::get<2>(replicas[j]));
-                salticidae::PeerId peer{cert_hash};
-
-                if (id == i) {
-                    HOTSTUFF_LOG_PROTO("Adding Child Process: %lld", j);
-                    children.insert(j);
-                    childPeers.insert(peer);
-                } else if (id == j) {
-                    HOTSTUFF_LOG_PROTO("Setting Parent Process: %lld", i);
-                    parentPeer = parent_peer;
-                } else if (childPeers.find(parent_peer) != childPeers.end()) {
-                    children.insert(j);
-                }
-            }
-            start += curr_fanout;
-            i++;
-            parent_cert_hash = std::move(std::get<2>(replicas[i]));
-            salticidae::PeerId temp_parent_peer{parent_cert_hash};
-            parent_peer = temp_parent_peer;
-        } // i = 1
-        processesOnLevel = std::min(curr_fanout * processesOnLevel, remaining); // 10
+    /* the tree edges go first, they are all consensus needs to start */
+    std::set<PeerId> neighbours;
+    for (const auto &view: trees)
+    {
+        if (!view.parent.is_null()) neighbours.insert(view.parent);
+        neighbours.insert(view.children.begin(), view.children.end());
+    }
+    vector<PeerId> newPeers(neighbours.begin(), neighbours.end());
+    size_t nneighbours = newPeers.size();
+    for (const auto &peer: peers)
+        if (!neighbours.count(peer)) newPeers.push_back(peer);
+
+    std::shuffle(newPeers.begin() + nneighbours, newPeers.end(), std::mt19937(std::random_device()()));
+    /* the others are connected when first needed */
+    if (sparse_mesh)
+    {
+        newPeers.resize(nneighbours);
+        lazy_timer = TimerEvent(ec, [this](TimerEvent &) { on_lazy_timer(); });
+        reap_timer = TimerEvent(ec, [this](TimerEvent &) { reap_idle_conns(); });
+        reap_timer.add(idle_conn_timeout);
     }
-
-    HOTSTUFF_LOG_PROTO("total children: %d", children.size());
-    numberOfChildren = children.size();
-
-    vector<PeerId> newPeers;
-    copy(peers.begin(), peers.end(), back_inserter(newPeers));
-
-    std::shuffle(newPeers.begin(), newPeers.end(), std::mt19937(std::random_device()()));
     for (const PeerId& peer : newPeers) {
         pn.conn_peer(peer);
-        usleep(10);
+        if (ctl_port_offset) pn_ctl.conn_peer(peer);
+    }
+    unready_neighbours.assign(neighbours.begin(), neighbours.end());
+    ready_timer = TimerEvent(ec, [this](TimerEvent &) { check_ready(); });
+    check_ready();
+
+    if (config.latency_tree) {
+        peer_rtts.assign(size, UINT32_MAX);
+        peer_rtts[id] = 0;
+        if (id == pmaker->get_proposer()) rtt_matrix.assign(size * size, UINT32_MAX);
+        latency_timer = TimerEvent(ec, [this](TimerEvent &) { on_latency_timer(); });
+        /* give the connections a moment to come up */
+        latency_timer.add(1);
     }
 
-    std::cout << " total children: " << children.size() << std::endl;
-    numberOfChildren = children.size();
+    /* on every replica, any of them may become the proposer */
+    if (config.reconfig_timeout > 0) {
+        reconfig_timer = TimerEvent(ec, [this](TimerEvent &) { on_reconfig_timer(); });
+        reconfig_timer.add(config.reconfig_timeout);
+    }
 
     /* ((n - 1) + 1 - 1) / 3 */
     uint32_t nfaulty = peers.size() / 3;
@@ -858,35 +1815,70 @@ void HotStuffBase::start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>>
     if (ec_loop)
         ec.dispatch();
 
-    cmd_pending_buffer.reserve(blk_size);
+    if (blk_size_max)
+        blk_size = std::min(std::max(blk_size, blk_size_min), blk_size_max);
+    cmd_pending_buffer.reserve(std::max(blk_size, blk_size_max));
+    /* at low load, do not keep the first commands waiting for a full block */
+    blk_cut_timer = TimerEvent(ec, [this](TimerEvent &) {
+        if (!cmd_pending_buffer.empty()) cut_block();
+    });
+    fwd_timer = TimerEvent(ec, [this](TimerEvent &) { flush_forwarded(); });
     cmd_pending.reg_handler(ec, [this](cmd_queue_t &q) {
-        std::pair<uint256_t, commit_cb_t> e;
+        PendingCmd e;
         while (q.try_dequeue(e))
         {
+            cmd_backlog.fetch_sub(1, std::memory_order_relaxed);
             ReplicaID proposer = pmaker->get_proposer();
             if (proposer != get_id()) {
+                if (e.callback)
+                {
+                    /* answer the client the way the proposer does: now, and
+                     * again once the decision reaches this replica */
+                    decision_waiting.insert(std::make_pair(e.cmd_hash, e.callback));
+                    e.callback(Finality(id, 0, 0, 0, e.cmd_hash, uint256_t()));
+                }
+                /* commands forwarded here from a replica that took this one
+                 * for the proposer are passed on as well */
+                if (fwd_cmds.empty())
+                    fwd_timer.add(cmd_forward_delay);
+                fwd_cmds.push_back(e.cmd_hash);
+                fwd_sizes.push_back(e.size);
+                if (fwd_cmds.size() >= blk_size)
+                    flush_forwarded();
                 continue;
             }
 
-            if (cmd_pending_buffer.size() < blk_size && final_buffer.empty()) {
-                const auto &cmd_hash = e.first;
-                auto it = decision_waiting.find(cmd_hash);
-                if (it == decision_waiting.end())
-                    it = decision_waiting.insert(std::make_pair(cmd_hash, e.second)).first;
-                
-                e.second(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
-                cmd_pending_buffer.push_back(cmd_hash);
-            }
-            else {
-                e.second(Finality(id, 0, 0, 0, e.first, uint256_t()));
-            }
+            /* forwarded commands were already answered, never drop them */
+            if (cmd_pending_buffer.size() < blk_size || !e.callback) {
+                const auto &cmd_hash = e.cmd_hash;
+                if (e.callback)
+                {
+                    auto it = decision_waiting.find(cmd_hash);
+                    if (it == decision_waiting.end())
+                        it = decision_waiting.insert(std::make_pair(cmd_hash, e.callback)).first;
 
-            if (cmd_pending_buffer.size() >= blk_size || !final_buffer.empty()) {
-                if (final_buffer.empty())
+                    e.callback(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
+                }
+                if (cmd_pending_buffer.empty())
                 {
-                    final_buffer = std::move(cmd_pending_buffer);
+                    cmd_pending_since = now_us();
+                    if (blk_deadline > 0)
+                        blk_cut_timer.add(blk_deadline);
                 }
+                cmd_pending_buffer.push_back(cmd_hash);
+                cmd_pending_bytes += e.size;
+            }
+            else if (e.callback) {
+                e.callback(Finality(id, 0, 0, 0, e.cmd_hash, uint256_t()));
+            }
 
+            if (cmd_pending_buffer.size() >= blk_size ||
+                (blk_bytes && cmd_pending_bytes >= blk_bytes)) {
+                cut_block();
+                return true;
+            }
+            /* keep proposing the last block until the next one is cut */
+            if (!final_buffer.empty()) {
                 beat();
                 return true;
             }
@@ -895,9 +1887,437 @@ void HotStuffBase::start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>>
     });
 }
 
+void HotStuffBase::cut_block() {
+    blk_cut_timer.del();
+    adapt_blk_size();
+    final_buffer = batch_size ?
+        disseminate_batches(std::move(cmd_pending_buffer)) :
+        std::move(cmd_pending_buffer);
+    cmd_pending_buffer.clear();
+    cmd_pending_bytes = 0;
+    beat();
+}
+
+void HotStuffBase::adapt_blk_size() {
+    if (!blk_size_max) return;
+    bool full = cmd_pending_buffer.size() >= blk_size ||
+                (blk_bytes && cmd_pending_bytes >= blk_bytes);
+    double fill_time = (now_us() - cmd_pending_since) / 1e3;
+    double qc_latency = pipe_ctl.get_qc_latency();
+    size_t backlog = cmd_backlog.load(std::memory_order_relaxed);
+    if (!full || (qc_latency > 0 && fill_time > 2 * qc_latency))
+        /* waiting for commands costs more than a round of consensus */
+        blk_size = std::max(blk_size / 2, blk_size_min);
+    else if (backlog >= blk_size || (qc_latency > 0 && fill_time < qc_latency))
+        /* commands arrive faster than blocks get certified, amortize more */
+        blk_size = std::min(blk_size + std::max((blk_size_max - blk_size_min) / 16, (size_t)1),
+                            blk_size_max);
+}
+
+std::vector<HotStuffBase::TreeView> HotStuffBase::derive_trees(
+        TopologyBuilder &builder, uint32_t epoch, uint32_t base_epoch,
+        std::vector<salticidae::Bits> *all_subtrees) {
+    const size_t size = replica_peers.size();
+    Tree tree = builder.build(size);
+    const auto &tree_parent = tree.parent;
+    /* the proposer takes the root position, the others follow in id order
+     * (so builders that place specific replicas see the replica ids when the
+     * proposer is replica 0) */
+    const ReplicaID root = pmaker->get_proposer();
+
+    auto base_order = [root](size_t p) -> ReplicaID {
+        return p == 0 ? root : (p - 1 < root ? p - 1 : p);
+    };
+
+    /* the root stays, the trees and the epochs hand the internal positions
+     * to successive groups of replicas: nobody is internal in two trees, and
+     * a failed internal node ends up as a leaf after a reconfiguration.
+     * Whatever the shape, the non-root positions are ranked internal ones
+     * first and the replicas move along that ranking. */
+    std::vector<size_t> ranked;
+    for (size_t p = 1; p < size; p++)
+        if (!tree.children[p].empty()) ranked.push_back(p);
+    const size_t ninternal = ranked.size();
+    for (size_t p = 1; p < size; p++)
+        if (tree.children[p].empty()) ranked.push_back(p);
+    size_t ntrees = std::max(config.ntrees, 1);
+    if (ninternal && ntrees * ninternal > size - 1)
+    {
+        ntrees = std::max((size - 1) / ninternal, (size_t)1);
+        HOTSTUFF_LOG_WARN("%d trees requested but only %d disjoint ones fit",
+                          (int)config.ntrees, (int)ntrees);
+    }
+
+    std::vector<TreeView> views(ntrees);
+    for (size_t k = 0; k < ntrees; k++)
+    {
+        auto &view = views[k];
+        size_t shift = size > 1 ?
+            (((epoch - base_epoch) * ntrees + k) * ninternal) % (size - 1) : 0;
+        std::vector<ReplicaID> order(size, root);
+        for (size_t j = 0; j < ranked.size(); j++)
+            order[ranked[j]] = base_order(ranked[(j + shift) % ranked.size()]);
+
+        size_t pos = 0;
+        while (pos < size && order[pos] != id) pos++;
+
+        std::vector<salticidae::Bits> subtrees(size, salticidae::Bits(size));
+        for (auto &subtree: subtrees) subtree.clear();
+        for (size_t p = 0; p < size; p++)
+        {
+            for (int a = p; a >= 0; a = tree_parent[a])
+                subtrees[order[a]].set(order[p]);
+            if (tree_parent[p] < 0) continue;
+            if ((size_t)tree_parent[p] == pos) {
+                HOTSTUFF_LOG_PROTO("Adding Child Process: %d (tree %d)", (int)order[p], (int)k);
+                view.children.insert(replica_peers[order[p]]);
+            } else if (p == pos) {
+                HOTSTUFF_LOG_PROTO("Setting Parent Process: %d (tree %d)", (int)order[tree_parent[p]], (int)k);
+                view.parent = replica_peers[order[tree_parent[p]]];
+            }
+        }
+
+        view.ndescendants = 0;
+        for (size_t r = 0; r < size; r++)
+            if (r != id && subtrees[id].get(r)) view.ndescendants++;
+        for (size_t p = 0; p < size; p++)
+        {
+            if (tree_parent[p] < 0 || (size_t)tree_parent[p] != pos) continue;
+            auto &below = view.child_subtree[replica_peers[order[p]]];
+            for (size_t r = 0; r < size; r++)
+                if (subtrees[order[p]].get(r)) below.push_back(r);
+        }
+        HOTSTUFF_LOG_PROTO("total children: %d (tree %d)", (int)view.ndescendants, (int)k);
+
+        if (all_subtrees)
+            all_subtrees->insert(all_subtrees->end(), subtrees.begin(), subtrees.end());
+    }
+    return views;
+}
+
+void HotStuffBase::build_tree(uint32_t epoch) {
+    if (topology == nullptr)
+        topology = topology_builder_bt(new TopologyKAry(config.fanout));
+    std::vector<salticidae::Bits> subtrees;
+    trees = derive_trees(*topology, epoch, tree_base_epoch, &subtrees);
+    /* seed the aggregated public keys of every subtree */
+    config.pubkey_agg_cache.clear();
+    for (const auto &subtree: subtrees)
+        config.pubkey_agg_cache.seed(config, subtree);
+    tree_epoch = epoch;
+}
+
+void HotStuffBase::switch_tree(uint32_t epoch, uint32_t height) {
+    HOTSTUFF_LOG_PROTO("switching to tree %d, voting again above height %d", epoch, height);
+    std::vector<TreeView> old_trees = std::move(trees);
+    build_tree(epoch);
+    /* pass it down the new trees, so that nobody switches before its parent
+     * and votes are never sent to a parent still on the old tree */
+    std::set<PeerId> children;
+    for (const auto &view: trees)
+        children.insert(view.children.begin(), view.children.end());
+    if (!children.empty())
+        multicast_lazy(MsgReconfig(epoch, tree_base_epoch, height, latency_rtts),
+                        std::vector<PeerId>(children.begin(), children.end()));
+    /* the votes to the new parents go over the vote lane */
+    if (sparse_mesh && ctl_port_offset)
+        for (const auto &view: trees)
+        {
+            if (!view.parent.is_null()) pn_ctl.conn_peer(view.parent);
+            for (const auto &child: view.children) pn_ctl.conn_peer(child);
+        }
+
+    /* partial aggregates of the old subtree are useless in the new one */
+    optimistic_votes.clear();
+    agg_deadlines.clear();
+    restarted_qcs.clear();
+    for (block_t b = last_voted; b != nullptr && b->get_height() > height;)
+    {
+        block_t blk = b;
+        if (b->get_parents().empty()) b = nullptr;
+        else b = b->get_parents()[0];
+        /* already certified, only waiting for its parent */
+        if (blk->self_qc != nullptr && blk->self_qc->has_n(config.nmajority)) continue;
+
+        Vote vote(id, blk->get_hash(), create_part_cert(*priv_key, blk->get_hash()), this);
+        const auto &view = tree_of(blk);
+        if (view.children.empty())
+            send_coalesced(MsgVote(vote), view.parent);
+        else if (id == pmaker->get_proposer() && blk->self_qc != nullptr)
+        {
+            /* the root keeps the votes it has, the new tree's aggregates
+             * are collected on the side in case they overlap them */
+            quorum_cert_bt fresh(create_quorum_cert(blk->get_hash()));
+            fresh->add_part(config, id, *vote.cert);
+            restarted_qcs[blk->get_hash()] = std::move(fresh);
+        }
+        else if (blk->self_qc == nullptr ||
+                tree_of(old_trees, blk).child_subtree != view.child_subtree)
+        {
+            blk->self_qc = create_quorum_cert(blk->get_hash());
+            blk->self_qc->add_part(config, id, *vote.cert);
+            if (id != pmaker->get_proposer() && config.agg_timeout > 0)
+                arm_agg_deadline(blk);
+        }
+        else if (subtree_complete(blk))
+            /* same subtree and complete, but the new parent may not have it */
+            send_coalesced(MsgRelay(VoteRelay(blk->get_hash(), blk->self_qc->clone(), this)), view.parent);
+        else if (config.agg_timeout > 0)
+            arm_agg_deadline(blk);
+    }
+}
+
+void HotStuffBase::reconfig_handler(MsgReconfig &&msg, const Net::conn_t &conn) {
+    const auto &peer = conn->get_peer_id();
+    if (peer.is_null() || msg.epoch <= tree_epoch || msg.base_epoch > msg.epoch) return;
+    bool new_topology = !msg.rtts.empty() && msg.rtts != latency_rtts;
+    topology_builder_bt builder;
+    if (new_topology)
+    {
+        try {
+            builder = latency_topology(msg.rtts);
+            builder->build(replica_peers.size());
+        } catch (std::invalid_argument &e) {
+            HOTSTUFF_LOG_WARN("ignoring the reconfiguration from %s: %s",
+                              get_hex10(peer).c_str(), e.what());
+            return;
+        }
+    }
+    /* only the proposer starts a reconfiguration, and only the new parents
+     * pass it on */
+    if (peer != replica_peers[pmaker->get_proposer()])
+    {
+        bool from_parent = false;
+        for (const auto &view: derive_trees(new_topology ? *builder : *topology,
+                                            msg.epoch, msg.base_epoch))
+            if (view.parent == peer) from_parent = true;
+        if (!from_parent)
+        {
+            HOTSTUFF_LOG_WARN("dropping the reconfiguration from %s, not a parent",
+                              get_hex10(peer).c_str());
+            return;
+        }
+    }
+    if (new_topology)
+    {
+        latency_rtts = std::move(msg.rtts);
+        topology = std::move(builder);
+    }
+    tree_base_epoch = msg.base_epoch;
+    switch_tree(msg.epoch, msg.height);
+}
+
+void HotStuffBase::ping_handler(MsgPing &&msg, const Net::conn_t &conn) {
+    const auto &peer = conn->get_peer_id();
+    if (peer.is_null()) return;
+    pn.send_msg(MsgPong(msg.ts), peer);
+}
+
+void HotStuffBase::pong_handler(MsgPong &&msg, const Net::conn_t &conn) {
+    const auto &peer = conn->get_peer_id();
+    if (peer.is_null()) return;
+    auto it = std::find(replica_peers.begin(), replica_peers.end(), peer);
+    if (it == replica_peers.end() || peer_rtts.empty()) return;
+    auto &rtt = peer_rtts[it - replica_peers.begin()];
+    rtt = std::min(rtt, (uint32_t)std::min(now_us() - msg.ts, (uint64_t)UINT32_MAX - 1));
+}
+
+void HotStuffBase::rtt_report_handler(MsgRttReport &&msg, const Net::conn_t &conn) {
+    const auto &peer = conn->get_peer_id();
+    if (peer.is_null() || rtt_matrix.empty() || !latency_rtts.empty()) return;
+    const size_t size = replica_peers.size();
+    auto it = std::find(replica_peers.begin(), replica_peers.end(), peer);
+    if (it == replica_peers.end() || msg.rtts.size() != size) return;
+    std::copy(msg.rtts.begin(), msg.rtts.end(), rtt_matrix.begin() + (it - replica_peers.begin()) * size);
+    /* a replica may report again, count it once */
+    rtt_reporters.insert(it - replica_peers.begin());
+    if (rtt_reporters.size() == size)
+        install_latency_tree();
+}
+
+void HotStuffBase::on_latency_timer() {
+    const size_t nrounds = 5;
+    if (latency_round < nrounds)
+    {
+        /* keep the smallest of a few samples to filter out queueing */
+        multicast_lazy(MsgPing(now_us()), peers);
+        latency_round++;
+        latency_timer.add(0.2);
+    }
+    else if (latency_round == nrounds)
+    {
+        latency_round++;
+        if (id == pmaker->get_proposer())
+        {
+            std::copy(peer_rtts.begin(), peer_rtts.end(), rtt_matrix.begin() + id * replica_peers.size());
+            rtt_reporters.insert(id);
+            if (rtt_reporters.size() == replica_peers.size())
+                install_latency_tree();
+            else /* do not wait forever for replicas that are down */
+                latency_timer.add(5);
+        }
+        else
+            send_lazy(MsgRttReport(peer_rtts), replica_peers[pmaker->get_proposer()]);
+    }
+    else
+        install_latency_tree();
+}
+
+topology_builder_bt HotStuffBase::latency_topology(const std::vector<uint32_t> &rtts) {
+    /* the builder places positions, renumber the replicas the way
+     * derive_trees maps them in the base epoch: the proposer first */
+    const size_t size = replica_peers.size();
+    const ReplicaID root = pmaker->get_proposer();
+    if (rtts.size() != size * size)
+        throw std::invalid_argument("the latency matrix does not match the replicas");
+    auto replica_at = [root](size_t p) -> size_t {
+        return p == 0 ? root : (p - 1 < root ? p - 1 : p);
+    };
+    std::vector<uint32_t> by_pos(size * size);
+    for (size_t a = 0; a < size; a++)
+        for (size_t b = 0; b < size; b++)
+            by_pos[a * size + b] = rtts[replica_at(a) * size + replica_at(b)];
+    return topology_builder_bt(new TopologyLatency(config.fanout, std::move(by_pos)));
+}
+
+void HotStuffBase::install_latency_tree() {
+    if (rtt_matrix.empty() || !latency_rtts.empty()) return;
+    latency_rtts = std::move(rtt_matrix);
+    topology = latency_topology(latency_rtts);
+    tree_base_epoch = tree_epoch + 1;
+    HOTSTUFF_LOG_INFO("switching to the latency-aware tree with %d reports", (int)rtt_reporters.size());
+    switch_tree(tree_epoch + 1, hqc.first->get_height());
+}
+
+void HotStuffBase::on_reconfig_timer() {
+    uint32_t height = hqc.first->get_height();
+    if (id == pmaker->get_proposer() &&
+        last_voted != nullptr && last_voted->get_height() > height &&
+        height == reconfig_last_height)
+    {
+        /* the QC is stuck behind a subtree that does not relay */
+        HOTSTUFF_LOG_WARN("no QC above height %d for %.2fs, rotating the tree",
+                          height, config.reconfig_timeout);
+        switch_tree(tree_epoch + 1, height);
+    }
+    reconfig_last_height = height;
+    reconfig_timer.add(config.reconfig_timeout);
+}
+
+void HotStuffBase::check_ready() {
+    auto connected = [](Net &net, const PeerId &peer) {
+        try {
+            return net.get_peer_conn(peer) != nullptr;
+        } catch (std::exception &) {
+            return false;
+        }
+    };
+    unready_neighbours.erase(std::remove_if(
+        unready_neighbours.begin(), unready_neighbours.end(),
+        [this, &connected](const PeerId &peer) {
+            return connected(pn, peer) && (!ctl_port_offset || connected(pn_ctl, peer));
+        }), unready_neighbours.end());
+    if (!unready_neighbours.empty())
+    {
+        ready_timer.add(ready_poll_interval);
+        return;
+    }
+    HOTSTUFF_LOG_INFO("connected to all tree neighbours");
+    for (const auto &view: trees)
+    {
+        if (!view.parent.is_null()) live_peers[view.parent] = now_us();
+        for (const auto &child: view.children) live_peers[child] = now_us();
+    }
+    is_ready = true;
+    ready.resolve(true);
+    if (beat_deferred)
+    {
+        beat_deferred = false;
+        beat();
+    }
+}
+
+bool HotStuffBase::is_neighbour(const PeerId &peer) const {
+    for (const auto &view: trees)
+        if (view.parent == peer || view.children.count(peer)) return true;
+    return false;
+}
+
+bool HotStuffBase::lazy_ready(const PeerId &peer) {
+    if (!sparse_mesh) return true;
+    auto it = live_peers.find(peer);
+    if (it != live_peers.end())
+    {
+        it->second = now_us();
+        return true;
+    }
+    if (!lazy_pending.count(peer))
+    {
+        lazy_pending[peer];
+        pn.conn_peer(peer);
+        if (!lazy_armed)
+        {
+            lazy_armed = true;
+            lazy_timer.add(ready_poll_interval);
+        }
+    }
+    return false;
+}
+
+void HotStuffBase::on_lazy_timer() {
+    lazy_armed = false;
+    for (auto it = lazy_pending.begin(); it != lazy_pending.end();)
+    {
+        const PeerId peer = it->first;
+        Net::conn_t conn;
+        try {
+            conn = pn.get_peer_conn(peer);
+        } catch (std::exception &) {}
+        if (conn == nullptr)
+        {
+            it++;
+            continue;
+        }
+        live_peers[peer] = now_us();
+        auto sends = std::move(it->second);
+        it = lazy_pending.erase(it);
+        for (auto &send: sends) send();
+    }
+    if (!lazy_pending.empty())
+    {
+        lazy_armed = true;
+        lazy_timer.add(ready_poll_interval);
+    }
+}
+
+void HotStuffBase::reap_idle_conns() {
+    const uint64_t now = now_us();
+    for (auto it = live_peers.begin(); it != live_peers.end();)
+    {
+        const PeerId peer = it->first;
+        if (is_neighbour(peer) || now - it->second < idle_conn_timeout * 1e6)
+        {
+            it++;
+            continue;
+        }
+        HOTSTUFF_LOG_PROTO("closing the idle connection to %s", get_hex10(peer).c_str());
+        /* forget the connection but keep the address for the next time */
+        pn.del_peer(peer);
+        pn.add_peer(peer);
+        pn.set_peer_addr(peer, peer_addrs[peer]);
+        it = live_peers.erase(it);
+    }
+    reap_timer.add(idle_conn_timeout);
+}
+
 void HotStuffBase::beat() {
+    if (!is_ready)
+    {
+        beat_deferred = true;
+        return;
+    }
     pmaker->beat().then([this](ReplicaID proposer) {
-        if (piped_queue.size() > get_config().async_blocks + 1) {
+        if (piped_window.size() > get_config().async_blocks + 1) {
             return;
         }
 
@@ -912,17 +2332,15 @@ void HotStuffBase::beat() {
             gettimeofday(&current_time, NULL);
             block_t current = pmaker->get_current_proposal();
 
-            if (piped_queue.size() < get_config().async_blocks && current != get_genesis()) {
+            if (piped_window.size() < get_config().async_blocks && current != get_genesis()) {
 
-                if (piped_queue.empty() && ((current_time.tv_sec - last_block_time.tv_sec) * 1000000 + current_time.tv_usec -last_block_time.tv_usec) / 1000 < config.piped_latency) {
+                if (piped_window.empty() && ((current_time.tv_sec - last_block_time.tv_sec) * 1000000 + current_time.tv_usec -last_block_time.tv_usec) / 1000 < config.piped_latency) {
                     HOTSTUFF_LOG_PROTO("omitting propose");
                 } else {
+                    /* pipelined blocks extend each other, the newest is the highest */
                     block_t highest = current;
-                    for (auto p_hash : piped_queue) {
-                        block_t block = storage->find_blk(p_hash);
-                        if (block->height > highest->height) {
-                            highest = block;
-                        }
+                    if (!piped_window.empty() && piped_window.back()->height > highest->height) {
+                        highest = piped_window.back();
                     }
 
                     if (parents[0]->height < highest->height) {
@@ -934,7 +2352,8 @@ void HotStuffBase::beat() {
                                                              parents[0]->height + 1,
                                                              current,
                                                              nullptr));
-                    piped_queue.push_back(piped_block->hash);
+                    piped_window.push_back(piped_block);
+                    pipe_ctl.on_propose(piped_block->get_hash());
 
                     Proposal prop(id, piped_block, nullptr);
                     HOTSTUFF_LOG_PROTO("propose piped %s", std::string(*piped_block).c_str());
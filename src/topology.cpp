@@ -0,0 +1,197 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "hotstuff/topology.h"
+
+namespace hotstuff {
+
+Tree::Tree(std::vector<int> &&_parent): parent(std::move(_parent)) {
+    const size_t n = parent.size();
+    if (n && parent[0] != -1)
+        throw std::invalid_argument("replica 0 must be the root");
+    children.resize(n);
+    for (size_t r = 1; r < n; r++)
+    {
+        if (parent[r] < 0 || (size_t)parent[r] >= n || (size_t)parent[r] == r)
+            throw std::invalid_argument("invalid parent of replica " + std::to_string(r));
+        children[parent[r]].push_back(r);
+    }
+    /* every replica must reach the root */
+    for (size_t r = 1; r < n; r++)
+    {
+        size_t steps = 0;
+        for (int a = r; a > 0; a = parent[a])
+            if (++steps > n)
+                throw std::invalid_argument("cycle through replica " + std::to_string(r));
+    }
+}
+
+Tree TopologyStar::build(size_t nreplicas) {
+    std::vector<int> parent(nreplicas, 0);
+    if (nreplicas) parent[0] = -1;
+    return Tree(std::move(parent));
+}
+
+Tree TopologyKAry::build(size_t nreplicas) {
+    std::vector<int> parent(nreplicas, -1);
+    size_t processesOnLevel = 1;
+    bool done = false;
+    size_t i = 0;
+    while (i < nreplicas && !done) {
+        const size_t remaining = nreplicas - i;
+        const size_t max_fanout = remaining / processesOnLevel;
+        auto curr_fanout = std::min(max_fanout, fanout);
+
+        auto start = i + processesOnLevel;
+        for (size_t counter = 1; counter <= processesOnLevel && !done; counter++) {
+            for (size_t j = start; j < start + curr_fanout; j++) {
+                if (j >= nreplicas) {
+                    done = true;
+                    break;
+                }
+                parent[j] = i;
+            }
+            start += curr_fanout;
+            i++;
+        }
+        processesOnLevel = std::min(curr_fanout * processesOnLevel, remaining);
+    }
+    return Tree(std::move(parent));
+}
+
+Tree TopologyDegreeBounded::build(size_t nreplicas) {
+    if (max_degree == 0)
+        throw std::invalid_argument("the degree bound must be positive");
+    auto bw = [this](ReplicaID r) {
+        return r < bandwidth.size() ? bandwidth[r] : 0;
+    };
+    /* the root stays, the others are placed by decreasing bandwidth */
+    std::vector<ReplicaID> order;
+    for (size_t r = 1; r < nreplicas; r++) order.push_back(r);
+    std::stable_sort(order.begin(), order.end(), [&bw](ReplicaID a, ReplicaID b) {
+        return bw(a) > bw(b);
+    });
+
+    std::vector<int> parent(nreplicas, -1);
+    /* fill breadth first, so the first replicas of the order get the children */
+    std::vector<ReplicaID> placed{0};
+    size_t next_parent = 0, degree = 0;
+    for (auto r: order)
+    {
+        if (degree == max_degree)
+        {
+            next_parent++;
+            degree = 0;
+        }
+        parent[r] = placed[next_parent];
+        placed.push_back(r);
+        degree++;
+    }
+    return Tree(std::move(parent));
+}
+
+Tree TopologyLatency::build(size_t nreplicas) {
+    if (rtts.size() != nreplicas * nreplicas)
+        throw std::invalid_argument("the latency matrix does not match the replicas");
+    if (fanout == 0)
+        throw std::invalid_argument("the fanout must be positive");
+    const uint64_t unknown = UINT32_MAX;
+    /* measurements may differ in the two directions, trust the worse one */
+    auto rtt = [this, nreplicas](size_t a, size_t b) {
+        return (uint64_t)std::max(rtts[a * nreplicas + b], rtts[b * nreplicas + a]);
+    };
+
+    /* Dijkstra from the root under the degree bound: always attach the
+     * replica that can be reached the earliest, ties broken by the smaller
+     * replica id so that everybody derives the same tree */
+    std::vector<int> parent(nreplicas, -1);
+    std::vector<uint64_t> dist(nreplicas, 0);
+    std::vector<size_t> degree(nreplicas, 0);
+    std::vector<bool> attached(nreplicas, false);
+    if (nreplicas) attached[0] = true;
+    for (size_t step = 1; step < nreplicas; step++)
+    {
+        int best_u = -1, best_v = -1;
+        uint64_t best = 0;
+        for (size_t u = 0; u < nreplicas; u++)
+        {
+            if (!attached[u] || degree[u] >= fanout) continue;
+            for (size_t v = 1; v < nreplicas; v++)
+            {
+                if (attached[v]) continue;
+                uint64_t d = dist[u] + std::min(rtt(u, v), unknown);
+                if (best_v < 0 || d < best || (d == best && (int)v < best_v))
+                {
+                    best = d;
+                    best_u = u;
+                    best_v = v;
+                }
+            }
+        }
+        parent[best_v] = best_u;
+        dist[best_v] = best;
+        degree[best_u]++;
+        attached[best_v] = true;
+    }
+    return Tree(std::move(parent));
+}
+
+std::vector<double> TopologyDegreeBounded::read_bandwidth(const std::string &fname) {
+    std::ifstream f(fname);
+    if (!f)
+        throw std::invalid_argument("cannot open bandwidth file " + fname);
+    std::vector<double> bandwidth;
+    std::string line;
+    while (std::getline(f, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+        bandwidth.push_back(std::stod(line));
+    }
+    return bandwidth;
+}
+
+Tree TopologyFile::build(size_t nreplicas) {
+    std::ifstream f(fname);
+    if (!f)
+        throw std::invalid_argument("cannot open topology file " + fname);
+    std::vector<int> parent(nreplicas, -1);
+    std::vector<bool> listed(nreplicas, false);
+    if (nreplicas) listed[0] = true;
+    std::string line;
+    while (std::getline(f, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        long r, p;
+        if (!(ss >> r >> p) || r < 0 || (size_t)r >= nreplicas)
+            throw std::invalid_argument("ill-formed topology line: " + line);
+        parent[r] = p;
+        listed[r] = true;
+    }
+    for (size_t r = 0; r < nreplicas; r++)
+        if (!listed[r])
+            throw std::invalid_argument("no parent for replica " + std::to_string(r));
+    return Tree(std::move(parent));
+}
+
+}
@@ -0,0 +1,100 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "hotstuff/erasure.h"
+
+using namespace hotstuff;
+
+static bytearray_t make_data(size_t size) {
+    bytearray_t data(size);
+    for (size_t i = 0; i < size; i++) data[i] = (i * 131 + 7) & 0xff;
+    return data;
+}
+
+/* every k-subset of the n fragments gives the data back */
+static void test_any_k_of_n(size_t k, size_t n, size_t size) {
+    ReedSolomon rs(k, n);
+    bytearray_t data = make_data(size);
+    auto frags = rs.encode(data.data(), data.size());
+    assert(frags.size() == n);
+    for (size_t j = 0; j < k; j++)
+        for (size_t i = 0; i < frags[j].size() && j * frags[j].size() + i < size; i++)
+            assert(frags[j][i] == data[j * frags[j].size() + i]);
+
+    size_t nsubsets = 0;
+    for (unsigned mask = 0; mask < (1u << n); mask++)
+    {
+        if ((size_t)__builtin_popcount(mask) != k) continue;
+        std::map<uint32_t, bytearray_t> some;
+        for (size_t i = 0; i < n; i++)
+            if (mask & (1u << i)) some[i] = frags[i];
+        assert(rs.decode(some, size) == data);
+        nsubsets++;
+    }
+    assert(nsubsets > 0);
+}
+
+static void test_too_few() {
+    ReedSolomon rs(3, 5);
+    bytearray_t data = make_data(100);
+    auto frags = rs.encode(data.data(), data.size());
+    std::map<uint32_t, bytearray_t> some{{0, frags[0]}, {4, frags[4]}};
+    bool thrown = false;
+    try {
+        rs.decode(some, data.size());
+    } catch (std::invalid_argument &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+static void test_merkle(size_t nleaves) {
+    std::vector<bytearray_t> leaves;
+    for (size_t i = 0; i < nleaves; i++) leaves.push_back(make_data(i + 1));
+    std::vector<std::vector<uint256_t>> proofs;
+    uint256_t root = MerkleTree::build(leaves, proofs);
+    assert(proofs.size() == nleaves);
+    for (size_t i = 0; i < nleaves; i++)
+    {
+        assert(proofs[i].size() == MerkleTree::proof_size(nleaves));
+        assert(MerkleTree::verify(root, leaves[i], i, proofs[i]));
+        /* a leaf does not pass for another one, nor a proof for a longer tree */
+        if (nleaves > 1)
+            assert(!MerkleTree::verify(root, leaves[(i + 1) % nleaves], i, proofs[i]));
+        assert(!MerkleTree::verify(root, leaves[i], i + (1 << proofs[i].size()), proofs[i]));
+        auto tampered = leaves[i];
+        tampered[0] ^= 1;
+        assert(!MerkleTree::verify(root, tampered, i, proofs[i]));
+    }
+}
+
+int main() {
+    test_any_k_of_n(1, 1, 10);
+    test_any_k_of_n(1, 4, 33);
+    test_any_k_of_n(3, 7, 100);
+    test_any_k_of_n(4, 10, 4097);
+    test_any_k_of_n(5, 5, 3);
+    test_too_few();
+    for (size_t n = 1; n <= 17; n++) test_merkle(n);
+    printf("ok\n");
+    return 0;
+}
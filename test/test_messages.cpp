@@ -0,0 +1,198 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "hotstuff/hotstuff.h"
+
+using namespace hotstuff;
+
+/* the message rebuilt from its own serialization */
+template<typename M>
+static M round_trip(M &msg) {
+    return M(std::move(msg.serialized));
+}
+
+/* whether deserializing `s` as M is refused */
+template<typename M>
+static bool rejects(DataStream &&s) {
+    try {
+        M msg(std::move(s));
+    } catch (std::exception &) {
+        return true;
+    }
+    return false;
+}
+
+static void test_reconfig() {
+    MsgReconfig msg(5, 2, 42, {0, 10, 20, 30});
+    MsgReconfig back = round_trip(msg);
+    assert(back.epoch == 5 && back.base_epoch == 2 && back.height == 42);
+    assert((back.rtts == std::vector<uint32_t>{0, 10, 20, 30}));
+
+    MsgReconfig none(1, 0, 0);
+    assert(round_trip(none).rtts.empty());
+
+    /* a length the payload cannot hold */
+    DataStream s;
+    s << htole((uint32_t)5) << htole((uint32_t)2) << htole((uint32_t)42)
+        << htole((uint32_t)1000000) << htole((uint32_t)0);
+    assert(rejects<MsgReconfig>(std::move(s)));
+}
+
+static void test_ping_pong() {
+    MsgPing ping(1234567890123ull);
+    assert(round_trip(ping).ts == 1234567890123ull);
+    MsgPong pong(987654321ull);
+    assert(round_trip(pong).ts == 987654321ull);
+}
+
+static void test_rtt_report() {
+    MsgRttReport msg({0, 150, UINT32_MAX});
+    assert((round_trip(msg).rtts == std::vector<uint32_t>{0, 150, UINT32_MAX}));
+
+    DataStream s;
+    s << htole((uint32_t)UINT32_MAX) << htole((uint32_t)0);
+    assert(rejects<MsgRttReport>(std::move(s)));
+}
+
+static void test_propose_chunk() {
+    const uint8_t data[] = {1, 2, 3, 4, 5};
+    uint256_t digest = salticidae::get_hash(bytearray_t(data, data + 5));
+    MsgProposeChunk msg(1, digest, 2, 7, data, data + 5);
+    MsgProposeChunk back = round_trip(msg);
+    back.parse_header();
+    assert(back.tree == 1 && back.digest == digest);
+    assert(back.idx == 2 && back.nchunks == 7);
+    assert(back.serialized.size() == 5);
+    assert(bytearray_t(back.serialized.data(), back.serialized.data() + 5) ==
+            bytearray_t(data, data + 5));
+}
+
+static void test_fragments() {
+    Fragment f;
+    f.idx = 3;
+    f.data = bytearray_t{9, 8, 7};
+    f.proof.resize(2);
+    f.proof[0] = salticidae::get_hash(bytearray_t{1});
+    f.proof[1] = salticidae::get_hash(bytearray_t{2});
+    uint256_t digest = salticidae::get_hash(bytearray_t{3});
+    uint256_t root = salticidae::get_hash(bytearray_t{4});
+    MsgFragments msg(2, true, digest, root, 1000, {f, f});
+    MsgFragments back = round_trip(msg);
+    assert(back.tree == 2 && back.relay && back.digest == digest);
+    assert(back.root == root && back.size == 1000 && back.frags.size() == 2);
+    for (const auto &g: back.frags)
+        assert(g.idx == 3 && g.data == f.data && g.proof == f.proof);
+
+    /* a fragment longer than the message */
+    DataStream s;
+    s << (uint8_t)0 << (uint8_t)0 << digest << root << htole((uint32_t)10)
+        << htole((uint32_t)1) << htole((uint32_t)0) << htole((uint32_t)1000000)
+        << htole((uint32_t)0);
+    assert(rejects<MsgFragments>(std::move(s)));
+}
+
+static void test_batches() {
+    std::vector<uint256_t> cmds{salticidae::get_hash(bytearray_t{1}),
+                                salticidae::get_hash(bytearray_t{2})};
+    MsgBatch batch(true, cmds);
+    MsgBatch batch_back = round_trip(batch);
+    assert(batch_back.relay && batch_back.cmds == cmds);
+    MsgBatch plain(false, {});
+    MsgBatch plain_back = round_trip(plain);
+    assert(!plain_back.relay && plain_back.cmds.empty());
+
+    MsgReqBatch req(cmds);
+    assert(round_trip(req).digests == cmds);
+
+    DataStream s;
+    s << (uint8_t)1 << htole((uint32_t)2) << cmds[0];
+    assert(rejects<MsgBatch>(std::move(s)));
+    DataStream r;
+    r << htole((uint32_t)1000);
+    assert(rejects<MsgReqBatch>(std::move(r)));
+}
+
+static void test_forward_cmds() {
+    std::vector<uint256_t> cmds{salticidae::get_hash(bytearray_t{5}),
+                                salticidae::get_hash(bytearray_t{6}),
+                                salticidae::get_hash(bytearray_t{7})};
+    std::vector<uint32_t> sizes{10, 0, 4096};
+    MsgForwardCmds msg(cmds, sizes);
+    MsgForwardCmds back = round_trip(msg);
+    assert(back.cmds == cmds && back.sizes == sizes);
+
+    DataStream s;
+    s << htole((uint32_t)2) << cmds[0] << htole((uint32_t)10);
+    assert(rejects<MsgForwardCmds>(std::move(s)));
+}
+
+/* appends `msg` the way a coalescing sender frames it */
+template<typename M>
+static void frame(DataStream &out, M &msg) {
+    out << M::opcode << htole((uint32_t)msg.serialized.size());
+    out.put_data(msg.serialized.data(), msg.serialized.data() + msg.serialized.size());
+}
+
+/* the next framed message of a bundle, after checking its opcode */
+template<typename M>
+static M unframe(DataStream &s) {
+    opcode_t opcode;
+    uint32_t len;
+    s >> opcode >> len;
+    len = letoh(len);
+    assert(opcode == M::opcode && len <= s.size());
+    const uint8_t *base = s.get_data_inplace(len);
+    DataStream payload;
+    payload.put_data(base, base + len);
+    return M(std::move(payload));
+}
+
+static void test_bundle() {
+    MsgPing ping(77);
+    MsgForwardCmds fwd({salticidae::get_hash(bytearray_t{8})}, {512});
+    MsgRttReport report(std::vector<uint32_t>{});
+    DataStream out;
+    frame(out, ping);
+    frame(out, fwd);
+    frame(out, report);
+    MsgBundle msg(std::move(out));
+    MsgBundle back = round_trip(msg);
+    auto &s = back.serialized;
+    assert(unframe<MsgPing>(s).ts == 77);
+    MsgForwardCmds fwd_back = unframe<MsgForwardCmds>(s);
+    assert(fwd_back.cmds.size() == 1 && fwd_back.sizes[0] == 512);
+    assert(unframe<MsgRttReport>(s).rtts.empty());
+    assert(s.size() == 0);
+}
+
+int main() {
+    test_reconfig();
+    test_ping_pong();
+    test_rtt_report();
+    test_propose_chunk();
+    test_fragments();
+    test_batches();
+    test_forward_cmds();
+    test_bundle();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+#include "hotstuff/consensus.h"
+
+using namespace hotstuff;
+
+/* a child of `parent`, `tag` tells apart siblings of the same height */
+static block_t make_blk(const block_t &parent, uint8_t tag = 0) {
+    return new Block({parent}, {}, quorum_cert_bt(new QuorumCertDummy()),
+                    bytearray_t{tag}, parent->get_height() + 1,
+                    block_t(nullptr), quorum_cert_bt(nullptr));
+}
+
+static std::vector<block_t> make_chain(const block_t &base, size_t n) {
+    std::vector<block_t> chain;
+    block_t prev = base;
+    for (size_t i = 0; i < n; i++)
+        chain.push_back(prev = make_blk(prev));
+    return chain;
+}
+
+static bool same(const std::vector<block_t> &a, const std::vector<block_t> &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i]->get_hash() != b[i]->get_hash()) return false;
+    return true;
+}
+
+static void test_out_of_order(const block_t &genesis) {
+    /* b[1] and b[2] get their QCs before b[0] does */
+    auto b = make_chain(genesis, 4);
+    PipelineWindow w;
+    for (auto &blk: b) w.push_back(blk);
+    w.set_certified(b[2]->get_hash());
+    w.set_certified(b[1]->get_hash());
+    auto drained = w.drain_certified(b[0]);
+    assert(same(drained, {b[1], b[2]}));
+    assert(w.size() == 2);
+    assert(w.contains(b[0]->get_hash()) && w.contains(b[3]->get_hash()));
+    assert(!w.contains(b[1]->get_hash()) && !w.contains(b[2]->get_hash()));
+    /* nothing left to drain */
+    assert(w.drain_certified(b[0]).empty());
+}
+
+static void test_gap(const block_t &genesis) {
+    auto b = make_chain(genesis, 4);
+    PipelineWindow w;
+    for (auto &blk: b) w.push_back(blk);
+    w.set_certified(b[2]->get_hash());
+    w.set_certified(b[3]->get_hash());
+    /* b[1] is still missing its QC, so nothing follows b[0] yet */
+    assert(w.drain_certified(b[0]).empty());
+    assert(w.size() == 4);
+    w.set_certified(b[1]->get_hash());
+    assert(same(w.drain_certified(b[0]), {b[1], b[2], b[3]}));
+    assert(w.size() == 1 && w.front()->get_hash() == b[0]->get_hash());
+    /* marking a block that is not in the window is a no-op */
+    w.set_certified(b[3]->get_hash());
+    assert(w.drain_certified(b[0]).empty());
+}
+
+static void test_fork(const block_t &genesis) {
+    /* b0 <- x <- y and b0 <- x2, only the x2 branch is certified */
+    auto b0 = make_blk(genesis);
+    auto x = make_blk(b0, 1);
+    auto x2 = make_blk(b0, 2);
+    auto y = make_blk(x2);
+    assert(x->get_hash() != x2->get_hash());
+    PipelineWindow w;
+    w.push_back(x);
+    w.push_back(x2);
+    w.push_back(y);
+    w.set_certified(y->get_hash());
+    w.set_certified(x2->get_hash());
+    assert(same(w.drain_certified(b0), {x2, y}));
+    assert(w.size() == 1 && w.contains(x->get_hash()));
+    /* the drained ones are unlinked, the sibling can still be drained */
+    w.set_certified(x->get_hash());
+    assert(same(w.drain_certified(b0), {x}));
+    assert(w.empty());
+}
+
+int main() {
+    block_t genesis = new Block(true, 1);
+    test_out_of_order(genesis);
+    test_gap(genesis);
+    test_fork(genesis);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "hotstuff/entity.h"
+
+using namespace hotstuff;
+
+static const size_t nreplicas = 4;
+
+struct Fixture {
+    ReplicaConfig config;
+    std::vector<PrivKeyBLS> keys;
+    uint256_t obj_hash;
+
+    Fixture(): keys(nreplicas) {
+        for (size_t i = 0; i < nreplicas; i++)
+        {
+            keys[i].from_rand();
+            config.add_replica(i, ReplicaInfo(i, salticidae::PeerId(), keys[i].get_pubkey()));
+        }
+        config.nmajority = 3;
+        obj_hash = salticidae::get_hash(bytearray_t{4, 2});
+    }
+
+    /* a certificate with the parts of `signers` added one by one */
+    QuorumCertAggBLS make(const std::vector<ReplicaID> &signers) {
+        QuorumCertAggBLS qc(config, obj_hash);
+        for (auto rid: signers)
+            qc.add_part(config, rid, PartCertBLSAgg(keys[rid], obj_hash));
+        return qc;
+    }
+};
+
+static void test_add_part(Fixture &f) {
+    QuorumCertAggBLS qc = f.make({0, 1, 2});
+    assert(qc.has_n(3) && !qc.has_n(4));
+    assert(qc.verify(f.config));
+
+    /* a signer added twice is folded once */
+    qc.add_part(f.config, 1, PartCertBLSAgg(f.keys[1], f.obj_hash));
+    assert(qc.has_n(3) && !qc.has_n(4));
+    assert(qc.verify(f.config));
+
+    /* a part of another object is refused */
+    bool thrown = false;
+    try {
+        qc.add_part(f.config, 3, PartCertBLSAgg(f.keys[3], salticidae::get_hash(bytearray_t{1})));
+    } catch (std::invalid_argument &) {
+        thrown = true;
+    }
+    assert(thrown && !qc.has_n(4));
+
+    /* a part signed by somebody else does not verify */
+    QuorumCertAggBLS bad = f.make({0, 1});
+    bad.add_part(f.config, 2, PartCertBLSAgg(f.keys[3], f.obj_hash));
+    assert(bad.has_n(3) && !bad.verify(f.config));
+
+    /* nothing added, nothing to verify */
+    QuorumCertAggBLS empty(f.config, f.obj_hash);
+    assert(!empty.has_n(1) && !empty.verify(f.config));
+}
+
+static void test_merge(Fixture &f) {
+    /* disjoint subtrees add up */
+    QuorumCertAggBLS left = f.make({0, 1});
+    QuorumCertAggBLS right = f.make({2, 3});
+    left.merge_quorum(right);
+    assert(left.has_n(4));
+    assert(left.verify(f.config));
+
+    /* overlapping ones are not merged, the aggregate stays valid */
+    QuorumCertAggBLS a = f.make({0, 1});
+    QuorumCertAggBLS b = f.make({1, 2});
+    a.merge_quorum(b);
+    assert(a.has_n(2) && !a.has_n(3));
+    assert(a.verify(f.config));
+
+    /* merging an empty certificate changes nothing */
+    QuorumCertAggBLS c = f.make({3});
+    c.merge_quorum(QuorumCertAggBLS(f.config, f.obj_hash));
+    assert(c.has_n(1) && !c.has_n(2));
+    assert(c.verify(f.config));
+
+    /* into an empty one, the merge is a copy */
+    QuorumCertAggBLS d(f.config, f.obj_hash);
+    d.merge_quorum(f.make({0, 2, 3}));
+    assert(d.has_n(3) && d.verify(f.config));
+}
+
+static void test_serialize(Fixture &f) {
+    QuorumCertAggBLS qc = f.make({0, 2, 3});
+    DataStream s;
+    s << qc;
+    QuorumCertAggBLS back;
+    s >> back;
+    assert(back.get_obj_hash() == f.obj_hash);
+    assert(back.has_n(3) && !back.has_n(4));
+    assert(back.verify(f.config));
+}
+
+int main() {
+    srand(7);
+    Fixture f;
+    test_add_part(f);
+    test_merge(f);
+    test_serialize(f);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * Copyright 2018 VMware
+ * Copyright 2018 Ted Yin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "hotstuff/task.h"
+
+using namespace hotstuff;
+
+/* a signature that is either good or bad, counting the individual checks */
+class FakeSig: public BatchVeriTask {
+    uint256_t msg;
+    bool valid;
+    size_t &nsingle;
+
+    public:
+    FakeSig(bool valid, size_t &nsingle, const uint256_t &msg = uint256_t()):
+        msg(msg), valid(valid), nsingle(nsingle) {}
+    const uint256_t &get_msg() const override { return msg; }
+    bool verify() override { nsingle++; return valid; }
+    bool verify_batch(const std::vector<BatchVeriTask *> &batch) override {
+        for (auto t: batch)
+            if (!static_cast<FakeSig *>(t)->valid) return false;
+        return true;
+    }
+};
+
+static bool run(const std::vector<bool> &valid, size_t &nsingle, std::vector<bool> &results) {
+    std::vector<FakeSig> sigs;
+    for (bool v: valid) sigs.emplace_back(v, nsingle);
+    VeriBatch batch;
+    for (auto &s: sigs) batch.add(&s);
+    bool ok = batch.verify();
+    results.clear();
+    for (auto &s: sigs) results.push_back(s.get_result());
+    return ok;
+}
+
+/* a batch opened while the timer is armed for an earlier one is flushed by
+ * its own deadline, not the earlier one's */
+static void test_windows() {
+    using clock = std::chrono::steady_clock;
+    const double window = 0.05, later = 0.03;
+    EventContext ec;
+    VeriPool pool(ec, 1);
+    pool.set_batch_window(window);
+    size_t nsingle = 0;
+    double t_first = -1, t_second = -1;
+    auto start = clock::now();
+    auto since = [start]() {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    pool.verify(veritask_ut(new FakeSig(true, nsingle, salticidae::get_hash(bytearray_t{1}))))
+        .then([&](bool ok) { assert(ok); t_first = since(); });
+    TimerEvent open_second(ec, [&](TimerEvent &) {
+        pool.verify(veritask_ut(new FakeSig(true, nsingle, salticidae::get_hash(bytearray_t{2}))))
+            .then([&](bool ok) { assert(ok); t_second = since(); ec.stop(); });
+    });
+    open_second.add(later);
+    /* in case the second batch is never flushed */
+    TimerEvent give_up(ec, [&](TimerEvent &) { ec.stop(); });
+    give_up.add(2);
+    ec.dispatch();
+
+    assert(t_first >= window);
+    /* flushed, and not together with the first batch */
+    assert(t_second >= later + window && t_second >= t_first);
+}
+
+int main() {
+    std::vector<bool> results;
+    size_t nsingle = 0;
+
+    /* a valid batch is settled by one batch check */
+    assert(run({true, true, true}, nsingle, results));
+    assert(nsingle == 0);
+    assert((results == std::vector<bool>{true, true, true}));
+
+    /* a bad signature makes the batch fall back to individual checks */
+    nsingle = 0;
+    assert(!run({true, false, true}, nsingle, results));
+    assert(nsingle == 3);
+    assert((results == std::vector<bool>{true, false, true}));
+
+    /* a lone task is checked on its own */
+    nsingle = 0;
+    assert(run({true}, nsingle, results));
+    assert(nsingle == 1);
+    nsingle = 0;
+    assert(!run({false}, nsingle, results));
+    assert((results == std::vector<bool>{false}));
+
+    test_windows();
+    printf("ok\n");
+    return 0;
+}